@@ -1,13 +1,108 @@
 
 #include "fs.h"
 
+#define VA2BLOCK(va)	(((uintptr_t) (va) - DISKMAP) / BLKSIZE)
+
+// The block cache holds at most BC_NBLOCKS blocks, and evicts blocks
+// with a CLOCK policy to make room for more; see bc_evict().
+static uint32_t bc_nmapped;	// Blocks mapped now
+static uint32_t bc_hand;	// Next block the CLOCK hand looks at
+static uint32_t bc_hits;	// Lookups of blocks that were mapped
+static uint32_t bc_misses;	// Blocks read in from disk
+static uint32_t bc_evictions;	// Blocks unmapped to make room
+
+// Blocks that are dirty, one bit per block.  Clean blocks are mapped
+// read-only, so the first write to one faults, and bc_pgfault adds it
+// here; write-back takes it out again and write-protects it.  A dirty
+// block is always mapped.
+static uint32_t bc_dirty[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_ndirty;	// Bits set in bc_dirty
+static uint32_t bc_dirty_end;	// No dirty blocks at or above this
+static unsigned bc_dirty_since;	// When the oldest write-back was due
+
+static bool
+bc_is_dirty(uint32_t blockno)
+{
+	return (bc_dirty[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+static void
+bc_set_dirty(uint32_t blockno)
+{
+	if (bc_is_dirty(blockno))
+		return;
+	bc_dirty[blockno / 32] |= 1 << (blockno % 32);
+	if (bc_ndirty++ == 0)
+		bc_dirty_since = sys_time_msec();
+	bc_dirty_end = MAX(bc_dirty_end, blockno + 1);
+}
+
+static void
+bc_clear_dirty(uint32_t blockno)
+{
+	if (!bc_is_dirty(blockno))
+		return;
+	bc_dirty[blockno / 32] &= ~(1 << (blockno % 32));
+	bc_ndirty--;
+}
+
+// Mark the block at va, just written back, clean: write-protect it
+// again, so that the next write to it makes it dirty.  A block that
+// clients map shared and may write (see bc_share) is left writable
+// and dirty, since their writes don't fault here.
+static void
+bc_clean(void *va)
+{
+	int perm;
+
+	perm = uvpt[PGNUM(va)] & PTE_SYSCALL;
+	if ((perm & PTE_SHARE) && pageref(va) > 1) {
+		if (perm & PTE_W)
+			return;
+	} else
+		perm &= ~PTE_SHARE;
+	bc_clear_dirty(VA2BLOCK(va));
+	// Remapping clears PTE_D too
+	sys_page_map(0, va, 0, va, perm & ~(PTE_W | PTE_COW));
+}
+
+// Disk commands in flight, up to BC_NIO of them.  With a disk that
+// takes several commands at once (disk_async), each command has pages
+// of its own in the staging area at BCSTAGEVA.  A read goes into new
+// pages there, which are mapped into the cache only once it is done,
+// so nothing sees a block half read.  A write goes from the blocks'
+// own pages, mapped there too, so that a write to a block while it is
+// going out faults and goes to a copy (see bc_pgfault), and the disk
+// gets what was flushed.  With a disk that does one command at a time,
+// commands are done before anything else runs, and they go straight
+// to and from the cache.
+#define BCSTAGEVA	0xD8000000
+#define IO2STAGE(io)	((char *) (BCSTAGEVA + ((io) - bc_io) * BC_IO_MAX * BLKSIZE))
+
+struct BcIo {
+	uint32_t io_blockno;	// First block
+	uint32_t io_n;		// Number of blocks, or 0 if the slot is free
+	bool io_write;
+	int io_tag;		// From disk_submit
+	uint32_t io_seq;	// Order the commands were started in
+};
+
+static struct BcIo bc_io[BC_NIO];
+static uint32_t bc_io_seq;
+static bool bc_stage;		// Commands go through the staging area
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
+	char *va;
+
 	if (blockno == 0 || (super && blockno >= super->s_nblocks))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	va = (char*) (DISKMAP + blockno * BLKSIZE);
+	if (va_is_mapped(va))
+		bc_hits++;
+	return va;
 }
 
 // Is this virtual address mapped?
@@ -21,17 +116,247 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return bc_is_dirty(VA2BLOCK(va));
+}
+
+// Is this virtual address mapped shared by clients, see bc_share()?
+bool
+va_is_shared(void *va)
+{
+	return va_is_mapped(va) && (uvpt[PGNUM(va)] & PTE_SHARE) &&
+		pageref(va) > 1;
+}
+
+// Unmap the cached block at va, which the caller has flushed.
+static void
+bc_unmap(void *va)
+{
+	sys_page_unmap(0, va);
+	bc_nmapped--;
+}
+
+// Make room for n more blocks, if the cache is that full, by evicting
+// some.  The CLOCK hand sweeps over the mapped blocks in block order.
+// A block that was accessed since the hand last passed it (PTE_A) gets
+// another chance, with PTE_A cleared, and one that wasn't is written
+// back if it is dirty and unmapped.  The superblock and the bitmap are
+// pinned, as are blocks that clients map shared, whose writes would
+// be lost.  If the hand finds too little to evict in two sweeps, the
+// cache grows instead.
+static void
+bc_evict(uint32_t n)
+{
+	uint32_t npinned, steps;
+	pte_t pte;
+	void *va;
+
+	if (!super)
+		return;
+
+	npinned = 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	for (steps = 0; bc_nmapped + n > BC_NBLOCKS &&
+	     steps < 2 * super->s_nblocks; steps++) {
+		if (bc_hand < npinned || bc_hand >= super->s_nblocks)
+			bc_hand = npinned;
+		va = (void *) (DISKMAP + bc_hand * BLKSIZE);
+
+		// Skip a page table's worth of blocks at once
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			bc_hand = ROUNDDOWN(bc_hand, NPTENTRIES) + NPTENTRIES;
+			continue;
+		}
+		bc_hand++;
+
+		pte = uvpt[PGNUM(va)];
+		if (!(pte & PTE_P) || va_is_shared(va))
+			continue;
+		if (pte & PTE_A) {
+			// Remapping clears PTE_A
+			sys_page_map(0, va, 0, va, pte & PTE_SYSCALL);
+			continue;
+		}
+
+		// A write-back has its own mapping of the page, so the
+		// block can go before the write is done
+		bc_flush_range(VA2BLOCK(va), 1);
+		bc_unmap(va);
+		bc_evictions++;
+	}
+}
+
+// Fill in the block cache's counters.
+void
+bc_stat(struct Fsret_cache_stat *st)
+{
+	st->ret_hits = bc_hits;
+	st->ret_misses = bc_misses;
+	st->ret_evictions = bc_evictions;
+	st->ret_nblocks = bc_nmapped;
+	st->ret_maxblocks = BC_NBLOCKS;
+}
+
+// Wait for the disk command io to be done, and put what it read into
+// the cache.  A block that couldn't be read is left out, so that its
+// next use faults and reads it again.
+static void
+bc_io_finish(struct BcIo *io)
+{
+	char *va, *stage;
+	uint32_t i;
+	int r;
+
+	va = (char *) (DISKMAP + io->io_blockno * BLKSIZE);
+	stage = bc_stage ? IO2STAGE(io) : va;
+	if ((r = disk_complete(io->io_tag)) < 0 && io->io_write)
+		panic("Failed to write back blocks %08x-%08x: %e",
+		      io->io_blockno, io->io_blockno + io->io_n - 1, r);
+
+	for (i = 0; i < io->io_n; i++, va += BLKSIZE, stage += BLKSIZE) {
+		if (io->io_write) {
+			if (bc_stage)
+				sys_page_unmap(0, stage);
+		} else if (r < 0) {
+			sys_page_unmap(0, stage);
+			bc_nmapped--;
+		} else {
+			// Mapping it clears the PTE_A and PTE_D the read set
+			sys_page_map(0, stage, 0, va, PTE_P|PTE_U);
+			if (bc_stage)
+				sys_page_unmap(0, stage);
+		}
+	}
+	io->io_n = 0;
+}
+
+// Return the disk command started first of those in flight, or NULL.
+static struct BcIo *
+bc_io_oldest(void)
+{
+	struct BcIo *io, *oldest = NULL;
+
+	for (io = bc_io; io < bc_io + BC_NIO; io++)
+		if (io->io_n && (!oldest ||
+				 (int32_t) (io->io_seq - oldest->io_seq) < 0))
+			oldest = io;
+	return oldest;
+}
+
+// Finish the disk commands in flight for any of the n blocks from
+// blockno.  Returns whether there were any.
+static bool
+bc_io_wait(uint32_t blockno, uint32_t n)
+{
+	struct BcIo *io;
+	bool found = false;
+
+	for (io = bc_io; io < bc_io + BC_NIO; io++)
+		if (io->io_n && io->io_blockno < blockno + n &&
+		    blockno < io->io_blockno + io->io_n) {
+			bc_io_finish(io);
+			found = true;
+		}
+	return found;
+}
+
+// Is a disk command for blockno in flight?
+bool
+bc_is_pending(uint32_t blockno)
+{
+	struct BcIo *io;
+
+	for (io = bc_io; io < bc_io + BC_NIO; io++)
+		if (io->io_n && io->io_blockno <= blockno &&
+		    blockno < io->io_blockno + io->io_n)
+			return true;
+	return false;
+}
+
+// Finish every disk command in flight.
+void
+bc_drain(void)
+{
+	struct BcIo *io;
+
+	for (io = bc_io; io < bc_io + BC_NIO; io++)
+		if (io->io_n)
+			bc_io_finish(io);
+}
+
+// Start a disk command to read ('write' false) the n blocks from
+// blockno, which aren't cached, or to write back the n blocks from
+// blockno, which are, and mark them clean.  No command for the blocks
+// may be in flight already.  If all BC_NIO commands, or the disk, are
+// busy, this waits for the oldest command to be done first.  Fewer
+// blocks than asked may be read if memory is short.
+// Returns 0 on success, < 0 on error.
+static int
+bc_io_start(uint32_t blockno, uint32_t n, bool write)
+{
+	struct BcIo *io, *old;
+	char *va, *stage;
+	uint32_t i;
+	int r;
+
+	for (io = bc_io; io < bc_io + BC_NIO && io->io_n; io++)
+		/* do nothing */;
+	if (io == bc_io + BC_NIO) {
+		io = bc_io_oldest();
+		bc_io_finish(io);
+	}
+
+	va = (char *) (DISKMAP + blockno * BLKSIZE);
+	stage = bc_stage ? IO2STAGE(io) : va;
+	if (write) {
+		for (i = 0; i < n; i++) {
+			bc_clean(va + i * BLKSIZE);
+			if (bc_stage &&
+			    (r = sys_page_map(0, va + i * BLKSIZE, 0,
+					      stage + i * BLKSIZE, PTE_P|PTE_U)) < 0)
+				return r;
+		}
+	} else {
+		for (i = 0; i < n; i++)
+			if (sys_page_alloc(0, stage + i * BLKSIZE, PTE_P|PTE_U|PTE_W) < 0)
+				break;
+		if ((n = i) == 0)
+			return -E_NO_MEM;
+		bc_nmapped += n;
+		bc_misses += n;
+	}
+
+	while ((r = disk_submit(blockno * BLKSECTS, stage, n * BLKSECTS,
+				write)) == -E_DEVICE_BUSY &&
+	       (old = bc_io_oldest()) != NULL)
+		bc_io_finish(old);
+	if (r < 0) {
+		if (!write) {
+			for (i = 0; i < n; i++)
+				sys_page_unmap(0, stage + i * BLKSIZE);
+			bc_nmapped -= n;
+		}
+		return r;
+	}
+
+	io->io_blockno = blockno;
+	io->io_n = n;
+	io->io_write = write;
+	io->io_tag = r;
+	io->io_seq = bc_io_seq++;
+	return 0;
 }
 
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk.  A write to a cached block that is clean, and
+// so read-only, makes it dirty; if another env still maps the page
+// (see bc_snapshot), or it is being written back, the write goes to a
+// copy.  A block that is being read in already is just waited for.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	bool waited;
+	int perm, r;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -42,30 +367,53 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	// A block that isn't mapped may be being read in, or have been
+	// evicted while being written back, which must be done before
+	// it is read again
+	waited = !va_is_mapped(addr) && bc_io_wait(blockno, 1);
+	if (va_is_mapped(addr)) {
+		if (!(utf->utf_err & FEC_WR)) {
+			if (waited)
+				return;
+			panic("page fault in FS: eip %08x, va %08x, err %04x",
+			      utf->utf_eip, utf->utf_fault_va, utf->utf_err);
+		}
+		bc_set_dirty(blockno);
+		// The kernel copies a PTE_COW page when the write is retried
+		perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
+		if (pageref(addr) > 1 && !(perm & PTE_SHARE))
+			perm |= PTE_COW;
+		else
+			perm |= PTE_W;
+		if ((r = sys_page_map(0, addr, 0, addr, perm)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
 	// the disk.
 	//
 	// LAB 5: you code here:
-	uintptr_t start_va=ROUNDDOWN((uintptr_t)addr,BLKSIZE);
-	uint32_t sect_start=(start_va-DISKMAP) / SECTSIZE;
-
-	//Allocate page
-	if((r=sys_page_alloc(thisenv->env_id,(void*)start_va,PTE_U | PTE_P | PTE_W)) < 0){
-		panic("Failed to alloc page when disk page fault at %x : %e\n",addr,r);
-	}
-
-	//Read disk
-	if((r=ide_read(sect_start,(void*)start_va,BLKSIZE/SECTSIZE))<0){
+	//Read disk, in room made in the cache
+	bc_evict(1);
+	if((r=bc_io_start(blockno,1,false)) < 0){
 		panic("Failed to read disk for va %x : %e\n",addr,r);
 	}
-	
+	bc_io_wait(blockno,1);
+	if(!va_is_mapped(addr)){
+		panic("Failed to read disk for va %x\n",addr);
+	}
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+	// The block is mapped clean, read-only, and made dirty and
+	// writable if it is being written
+	if (utf->utf_err & FEC_WR) {
+		bc_set_dirty(blockno);
+		if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+	}
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -74,45 +422,193 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Read ahead up to n blocks starting at blockno, which the caller
+// expects to be read soon, into the cache, with as few disk commands
+// as possible.  Each run of consecutive blocks that aren't cached yet
+// is read with a single disk command, which is left in flight; the
+// first use of a block waits for it.  Blocks that are cached already
+// are left alone, since they may be dirty, as are blocks being read
+// in already.  The new blocks are mapped clean and not accessed, so
+// that the CLOCK hand evicts them first if they aren't used after all.
+void
+bc_prefetch(uint32_t blockno, uint32_t n)
+{
+	uint32_t end, run;
+	char *va;
+
+	if (!super || blockno >= super->s_nblocks)
+		return;
+	end = MIN(blockno + n, super->s_nblocks);
+
+	while (blockno < end) {
+		va = (char *) (DISKMAP + blockno * BLKSIZE);
+		if (va_is_mapped(va) || bc_is_pending(blockno)) {
+			blockno++;
+			continue;
+		}
+
+		// Find the run of blocks that aren't cached, and read it
+		for (run = 1; blockno + run < end && run < BC_IO_MAX &&
+			     !va_is_mapped(va + run * BLKSIZE) &&
+			     !bc_is_pending(blockno + run); run++)
+			/* do nothing */;
+		bc_evict(run);
+		if (bc_io_start(blockno, run, false) < 0)
+			return;
+		blockno += run;
+	}
+}
+
+// Write back the dirty blocks among the n blocks from blockno.  Each
+// run of consecutive dirty blocks, which are consecutive in DISKMAP
+// too, goes out with a single disk command of up to BC_IO_MAX blocks,
+// which is left in flight; the blocks are clean from now on.
+void
+bc_flush_range(uint32_t blockno, uint32_t n)
+{
+	uint32_t end, run;
+	int r;
+
+	end = MIN(blockno + n, bc_dirty_end);
+	while (blockno < end) {
+		if (!bc_is_dirty(blockno)) {
+			blockno++;
+			continue;
+		}
+		for (run = 1; blockno + run < end && run < BC_IO_MAX &&
+			     bc_is_dirty(blockno + run); run++)
+			/* do nothing */;
+
+		// An earlier write of the blocks still in flight could
+		// land after this one
+		bc_io_wait(blockno, run);
+		if ((r = bc_io_start(blockno, run, true)) < 0)
+			panic("Failed to write back blocks %08x-%08x: %e",
+			      blockno, blockno + run - 1, r);
+		blockno += run;
+	}
+}
+
+// Start writing back every dirty block, finding them in bc_dirty
+// rather than by looking at every block of the disk.  bc_drain waits
+// for the writes to be done.
+void
+bc_sync(void)
+{
+	uint32_t b, n;
+
+	for (b = 0; b < bc_dirty_end; b += n) {
+		n = 1;
+		if (bc_dirty[b / 32] == 0)
+			n = 32 - b % 32;
+		else if (bc_is_dirty(b)) {
+			n = MIN(BC_IO_MAX, bc_dirty_end - b);
+			bc_flush_range(b, n);
+		}
+	}
+	if (bc_ndirty == 0)
+		bc_dirty_end = 0;
+	// Blocks that stay dirty are next due an interval from now
+	bc_dirty_since = sys_time_msec();
+}
+
+// Return the time_msec() by which the dirty blocks are due to be
+// written back by bc_sync, ~0 if there are none, or 0 if there are
+// too many to wait.
+unsigned
+bc_flush_deadline(void)
+{
+	if (bc_ndirty == 0)
+		return ~0U;
+	if (bc_ndirty >= BC_DIRTY_MAX)
+		return 0;
+	return bc_dirty_since + BC_FLUSH_MSEC;
+}
+
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// it is dirty, and mark it clean, and wait for the write to be done.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
 void
 flush_block(void *addr)
 {
-	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
-	// LAB 5: Your code here.
-	
-	//Get page table entry first
-	uintptr_t va=ROUNDDOWN((uintptr_t)addr,PGSIZE);
-	if(!(PDE_USER(va) & PTE_P) || !(PTE_USER(va) & PTE_P)){
-		//Page does not exist, just return
-		return;
-	}
+	bc_flush_range(VA2BLOCK(addr), 1);
+	bc_io_wait(VA2BLOCK(addr), 1);
+}
 
-	pte_t* pte=&PTE_USER(va);
-	if(!(*pte & PTE_D)){
-		//Not dirty, just return
-		return;
-	}
+// Get the cached block at addr ready to be mapped into another env as
+// a snapshot, reading it in if needed.  Our own mapping becomes
+// read-only, so that our next write to the block faults and goes to a
+// copy (see bc_pgfault), and the other env keeps what it was given.
+// A dirty block stays dirty.  A block mapped shared by clients
+// (va_is_shared) can't be snapshotted this way.
+int
+bc_snapshot(void *addr)
+{
+	int perm;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	if (!va_is_mapped(addr))
+		*(volatile char *) addr;
 
-	//Write back to disk
-	uint32_t start_sect=(va-DISKMAP)/SECTSIZE;
+	perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
+	if (!(perm & PTE_W))
+		return 0;
+	return sys_page_map(0, addr, 0, addr, perm & ~(PTE_W | PTE_SHARE));
+}
+
+// Get the cached block at addr ready to be mapped shared into another
+// env, which is to see our later writes to it, and we its, reading it
+// in if needed.  A block that is snapshotted is made ours alone again,
+// by writing to it, and it is marked PTE_SHARE, so that it isn't
+// snapshotted or replaced while it is shared.  If the other env is to
+// write to it ('write'), our mapping must be writable too, and the
+// block is dirty, and stays so while it is shared; see bc_clean().
+int
+bc_share(void *addr, bool write)
+{
+	volatile char *p;
+	int perm;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	p = addr;
+	if (!va_is_mapped(addr))
+		(void) *p;
+	perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
+	if (!(perm & PTE_W) &&
+	    (write || (!(perm & PTE_SHARE) && pageref(addr) > 1)))
+		*p = *p;
+
+	return sys_page_map(0, addr, 0, addr,
+			    (uvpt[PGNUM(addr)] & PTE_SYSCALL) | PTE_SHARE);
+}
+
+// Make the page at pg, which holds a whole block of new data, the
+// cached block at addr in place of the old one, without copying it.
+// The block is dirty.  Whoever gave us pg may still map it, so it is
+// cached read-only, and our next write to it goes to a copy.
+int
+bc_replace(void *addr, void *pg)
+{
+	bool mapped;
 	int r;
-	if((r=ide_write(start_sect,(void*)va,PGSIZE/SECTSIZE)) < 0){
-		panic("Failed to write back to disk for va %x\n",addr);
-	}
 
-	//Reset dirty bit
-	sys_page_map(thisenv->env_id,(void*)va,thisenv->env_id,(void*)va,PTE_SYSCALL);
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	// A read of the block still in flight would map the old
+	// contents over pg
+	bc_io_wait(VA2BLOCK(addr), 1);
+	if (!(mapped = va_is_mapped(addr)))
+		bc_evict(1);
+
+	if ((r = sys_page_map(0, pg, 0, addr, PTE_P|PTE_U)) < 0)
+		return r;
+	if (!mapped)
+		bc_nmapped++;
+	bc_set_dirty(VA2BLOCK(addr));
+	return 0;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -132,7 +628,7 @@ check_bc(void)
 	assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	bc_unmap(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
@@ -160,7 +656,7 @@ check_bc(void)
 	//assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	bc_unmap(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
@@ -177,6 +673,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	bc_stage = disk_async();
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
@@ -0,0 +1,82 @@
+/*
+ * The disk the file system lives on, behind one interface for both
+ * kinds of disk we drive.
+ *
+ * A virtio disk, if the kernel found one, takes several requests at
+ * once: disk_submit queues a request and returns its tag right away,
+ * and disk_complete waits for it, so the block cache can keep reads
+ * and writes in flight while it goes on.  Otherwise we use the IDE
+ * disk, which does one command at a time; its requests are done by
+ * the time disk_submit returns.
+ */
+
+#include "fs.h"
+
+// The tag of an IDE request, which is done already
+#define DISK_TAG_DONE	0x10000
+
+static int blk_irq = -1;	// IRQ of the virtio disk, or -1 for IDE
+
+// Pick the disk: the virtio disk if there is one, or else the second
+// IDE disk (number 1) if available, or else the first.
+void
+disk_init(void)
+{
+	if ((blk_irq = sys_blk_probe()) >= 0) {
+		// Claim the IRQ, so that none of its interrupts are lost
+		sys_irq_wait(blk_irq, 0);
+		cprintf("FS is running on a virtio disk\n");
+		return;
+	}
+
+	if (ide_probe_disk1())
+		ide_set_disk(1);
+	else
+		ide_set_disk(0);
+	ide_dma_init();
+}
+
+// Does disk_submit return before the request is done?
+bool
+disk_async(void)
+{
+	return blk_irq >= 0;
+}
+
+// Start reading ('write' false) or writing the nsecs sectors from
+// secno on, into or from buf, which must stay mapped, and unchanged
+// for a write, until disk_complete says the request is done.
+// Returns the request's tag for disk_complete, or < 0 on error:
+// -E_DEVICE_BUSY means the disk has too many requests in flight to
+// take this one before one of them completes.
+int
+disk_submit(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	int r;
+
+	if (blk_irq >= 0)
+		return sys_blk_submit(secno, buf, nsecs, write);
+
+	if (write)
+		r = ide_write(secno, buf, nsecs);
+	else
+		r = ide_read(secno, buf, nsecs);
+	return r < 0 ? r : DISK_TAG_DONE;
+}
+
+// Wait for the request 'tag' from disk_submit to be done.
+// Returns 0 on success, < 0 if the disk failed it.
+int
+disk_complete(int tag)
+{
+	int r;
+
+	if (tag == DISK_TAG_DONE)
+		return 0;
+
+	// An interrupt may be for another request, or a stale one, so
+	// look at the request again after each
+	while ((r = sys_blk_poll(tag)) == 1)
+		sys_irq_wait(blk_irq, ~0U);
+	return r;
+}
@@ -71,7 +71,7 @@ alloc_block(void)
 		if(bitmap[i / 32] & (1 << (i % 32))){
 			//Found a free block
 			bitmap[i / 32] &= ~(1 << (i%32));
-			flush_block(bitmap);
+			flush_block(&bitmap[i / 32]);
 			return i;
 		}
 	}
@@ -111,12 +111,10 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
+	// Find a JOS disk
+	disk_init();
 	bc_init();
+	tcache_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
@@ -376,6 +374,8 @@ file_create(const char *path, struct File **pf)
 	if ((r = dir_alloc_file(dir, &f)) < 0)
 		return r;
 
+	// The slot may have held a file with pages in the text cache
+	tcache_invalidate(f);
 	strcpy(f->f_name, name);
 	*pf = f;
 	file_flush(dir);
@@ -417,6 +417,40 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// If block filebno of f isn't in the block cache, read it and the
+// blocks after it, through filebno+n-1 or the end of the file, into
+// the cache ahead of their use, and return true.  Runs of them that
+// are consecutive on disk are read in together; see bc_prefetch.
+// Holes in the file end the read-ahead.
+bool
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t *ptr, start, run, end;
+
+	if (file_block_walk(f, filebno, &ptr, 0) < 0 || *ptr == 0 ||
+	    va_is_mapped((void *) (DISKMAP + *ptr * BLKSIZE)) ||
+	    bc_is_pending(*ptr))
+		return false;
+
+	end = MIN(filebno + n, (f->f_size + BLKSIZE - 1) / BLKSIZE);
+	start = run = 0;
+	for (; filebno < end; filebno++) {
+		if (file_block_walk(f, filebno, &ptr, 0) < 0 || *ptr == 0)
+			break;
+		if (run > 0 && *ptr == start + run && run < BC_IO_MAX) {
+			run++;
+			continue;
+		}
+		if (run > 0)
+			bc_prefetch(start, run);
+		start = *ptr;
+		run = 1;
+	}
+	if (run > 0)
+		bc_prefetch(start, run);
+	return true;
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -429,6 +463,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	tcache_invalidate(f);
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
@@ -446,6 +482,37 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Write the page at pg, a whole block of data, as the block of f at
+// the block-aligned offset, extending f if necessary.  The page itself
+// goes into the block cache instead of being copied, unless clients
+// have mapped the block shared.
+// Returns 0, or < 0 on error.
+int
+file_write_block(struct File *f, off_t offset, void *pg)
+{
+	int r;
+	char *blk;
+
+	if (offset < 0 || offset % BLKSIZE != 0)
+		return -E_INVAL;
+
+	tcache_invalidate(f);
+
+	if (offset + BLKSIZE > f->f_size)
+		if ((r = file_set_size(f, offset + BLKSIZE)) < 0)
+			return r;
+
+	if ((r = file_get_block(f, offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	// Clients mapping the block shared must see the new data
+	if (va_is_shared(blk)) {
+		memmove(blk, pg, BLKSIZE);
+		return 0;
+	}
+	return bc_replace(blk, pg);
+}
+
 // Remove a block from file f.  If it's not there, just silently succeed.
 // Returns 0 on success, < 0 on error.
 static int
@@ -494,6 +561,7 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	tcache_invalidate(f);
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
@@ -503,32 +571,44 @@ file_set_size(struct File *f, off_t newsize)
 
 // Flush the contents and metadata of file f out to disk.
 // Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Translate the file block number into a disk block number, and
+// write back the dirty ones among each run of blocks that are
+// consecutive on disk together; see bc_flush_range.  The runs are all
+// in flight at once, and done when this returns.
 void
 file_flush(struct File *f)
 {
 	int i;
-	uint32_t *pdiskbno;
+	uint32_t *pdiskbno, start, run;
 
+	start = run = 0;
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		if (run > 0 && *pdiskbno == start + run) {
+			run++;
+			continue;
+		}
+		if (run > 0)
+			bc_flush_range(start, run);
+		start = *pdiskbno;
+		run = 1;
 	}
+	if (run > 0)
+		bc_flush_range(start, run);
 	flush_block(f);
 	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+		bc_flush_range(f->f_indirect, 1);
+	bc_drain();
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system.  Only the dirty blocks are written.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
+	bc_drain();
 }
 
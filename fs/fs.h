@@ -11,21 +11,65 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* PTE_SHARE marks a block cache page that is mapped shared by
+ * clients; see bc.c. */
+
+/* Most blocks in the block cache at once */
+#ifndef BC_NBLOCKS
+#define BC_NBLOCKS	4096
+#endif
+
+/* Most blocks read or written with one disk command, which moves at
+ * most 256 sectors */
+#define BC_IO_MAX	(256 / BLKSECTS)
+
+/* Most disk commands the block cache keeps in flight at once */
+#ifndef BC_NIO
+#define BC_NIO		16
+#endif
+
+/* Dirty blocks are written back at most BC_FLUSH_MSEC after the first
+ * of them was written, or once there are BC_DIRTY_MAX of them */
+#ifndef BC_FLUSH_MSEC
+#define BC_FLUSH_MSEC	1000
+#endif
+#ifndef BC_DIRTY_MAX
+#define BC_DIRTY_MAX	(BC_NBLOCKS / 8)
+#endif
+
 extern struct Super *super;		// superblock
 extern uint32_t *bitmap;		// bitmap blocks mapped in memory
 
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+bool	ide_dma_init(void);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* disk.c */
+void	disk_init(void);
+bool	disk_async(void);
+int	disk_submit(uint32_t secno, void *buf, size_t nsecs, bool write);
+int	disk_complete(int tag);
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
+bool	va_is_shared(void *va);
 void	flush_block(void *addr);
+void	bc_flush_range(uint32_t blockno, uint32_t n);
+void	bc_sync(void);
+void	bc_drain(void);
+bool	bc_is_pending(uint32_t blockno);
+unsigned bc_flush_deadline(void);
+int	bc_snapshot(void *addr);
+int	bc_share(void *addr, bool write);
+void	bc_stat(struct Fsret_cache_stat *st);
+int	bc_replace(void *addr, void *pg);
+void	bc_prefetch(uint32_t blockno, uint32_t n);
 void	bc_init(void);
 
 /* fs.c */
@@ -35,11 +79,18 @@ int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
+int	file_write_block(struct File *f, off_t offset, void *pg);
+bool	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
+/* tcache.c */
+void	tcache_init(void);
+int	tcache_get(struct File *f, uint32_t filebno, void **pg);
+void	tcache_invalidate(struct File *f);
+
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
@@ -1,5 +1,8 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use bus-master DMA when the
+ * kernel's pci_init found a controller that can do it, such as the
+ * PIIX, and we sleep until the disk interrupts; otherwise they fall
+ * back to PIO, with the CPU moving every word and polling the disk.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,7 +15,41 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+#define IDE_CTL		0x3F6	// Device control register
+#define IDE_CTL_NIEN	0x02	// No interrupts
+
+// Bus-master registers of the primary channel, from the base
+#define BM_CMD		0	// Command
+#define BM_CMD_START	0x01	//   Start the transfer
+#define BM_CMD_READ	0x08	//   From the disk to memory
+#define BM_STATUS	2	// Status; write a bit 1 to clear it
+#define BM_STATUS_ERR	0x02	//   The transfer failed
+#define BM_STATUS_INTR	0x04	//   The disk interrupted
+#define BM_PRDT		4	// Physical address of the PRD table
+
+// A physical region descriptor: one piece of a DMA transfer's buffer,
+// which must not cross a 64KB boundary
+struct IdePrd {
+	uint32_t prd_addr;	// Physical address
+	uint16_t prd_len;	// Bytes
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// The last descriptor of the table
+
+// Where the PRD table lives in our address space
+#define PRDVA		((struct IdePrd *) 0x0fffd000)
+
+// How long a DMA transfer may take before we give up on DMA
+#define IDE_DMA_MSEC	5000
+
 static int diskno = 1;
+static uint32_t bmbase;		// Bus-master registers, 0 for PIO
+static physaddr_t prdt_pa;	// Physical address of PRDVA
 
 static int
 ide_wait_ready(bool check_error)
@@ -59,22 +96,124 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Use bus-master DMA from now on, if the kernel found a controller
+// that can do it.  Returns whether it did.
+bool
+ide_dma_init(void)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	if ((r = sys_ide_dma_base()) < 0) {
+		cprintf("IDE: no bus master, using PIO\n");
+		return false;
+	}
+	bmbase = r;
 
-	ide_wait_ready(0);
+	if ((r = sys_page_alloc(0, PRDVA, PTE_P|PTE_U|PTE_W)) < 0 ||
+	    (r = sys_page_physaddr(PRDVA)) < 0) {
+		cprintf("IDE: no PRD table, using PIO: %e\n", r);
+		bmbase = 0;
+		return false;
+	}
+	prdt_pa = r;
 
+	// Take IRQ_IDE now, with a deadline that has passed already,
+	// so that the first transfer doesn't miss its interrupt
+	sys_irq_wait(IRQ_IDE, 0);
+	cprintf("IDE: bus-master DMA at io 0x%x\n", bmbase);
+	return true;
+}
+
+// Tell the disk to transfer nsecs sectors from secno with command cmd.
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	outb(0x1F2, nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Transfer nsecs sectors from secno to buf ('write' false) or from buf
+// to secno ('write' true) by DMA, sleeping until the disk interrupts.
+// The PRD table has a descriptor for each page of buf.  The device
+// writes the pages behind the MMU's back, so buf must be ours alone.
+// Returns 0 on success, < 0 if the transfer failed or timed out.
+static int
+ide_dma(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	uintptr_t va, end, next;
+	struct IdePrd *prd;
+	uint8_t cmd, status;
+	unsigned deadline;
+	int pa;
+
+	prd = PRDVA;
+	end = (uintptr_t) buf + nsecs * SECTSIZE;
+	for (va = (uintptr_t) buf; va < end; va = next, prd++) {
+		next = MIN(ROUNDDOWN(va, PGSIZE) + PGSIZE, end);
+		if ((pa = sys_page_physaddr((void *) va)) < 0)
+			return pa;
+		prd->prd_addr = pa;
+		prd->prd_len = next - va;
+		prd->prd_flags = 0;
+	}
+	prd[-1].prd_flags = PRD_EOT;
+
+	cmd = write ? 0 : BM_CMD_READ;
+	outb(bmbase + BM_CMD, 0);
+	outl(bmbase + BM_PRDT, prdt_pa);
+	outb(bmbase + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+	outb(bmbase + BM_CMD, cmd);
+
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(bmbase + BM_CMD, cmd | BM_CMD_START);
+
+	// An interrupt may be a stale one, so check the controller too
+	deadline = sys_time_msec() + IDE_DMA_MSEC;
+	while (!((status = inb(bmbase + BM_STATUS)) & BM_STATUS_INTR))
+		if (sys_irq_wait(IRQ_IDE, deadline) < 0)
+			break;
+
+	outb(bmbase + BM_CMD, 0);
+	outb(bmbase + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+	// Reading the disk's status acknowledges its interrupt
+	if (!(status & BM_STATUS_INTR) || (status & BM_STATUS_ERR) ||
+	    (inb(0x1F7) & (IDE_DF|IDE_ERR)))
+		return -1;
+	return 0;
+}
+
+// A DMA transfer failed: do everything with PIO from now on, with the
+// disk's interrupts, which nobody would wait for, turned off.
+static void
+ide_dma_fail(uint32_t secno)
+{
+	cprintf("IDE: DMA at sector %u failed, using PIO\n", secno);
+	bmbase = 0;
+	ide_wait_ready(0);
+	outb(IDE_CTL, IDE_CTL_NIEN);
+}
+
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	if (bmbase) {
+		if (ide_dma(secno, dst, nsecs, false) == 0)
+			return 0;
+		ide_dma_fail(secno);
+	}
+
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, IDE_CMD_READ);
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -92,14 +231,14 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
-	ide_wait_ready(0);
+	if (bmbase) {
+		if (ide_dma(secno, (void *) src, nsecs, true) == 0)
+			return 0;
+		ide_dma_fail(secno);
+	}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, IDE_CMD_WRITE);
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -34,6 +34,8 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	off_t o_ra_pos;		// where a sequential read would go next
+	uint32_t o_ra_window;	// blocks read ahead last time, 0 if none
 };
 
 // Max number of open files in the file system at once
@@ -48,6 +50,15 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Blocks read ahead when a sequential stream of reads first misses
+// the block cache.  The window doubles on each later miss, up to what
+// one disk command can read.
+#define RA_MIN		4
+#define RA_MAX		BC_IO_MAX
+
+// Virtual address at which serve_pagein fills in pages.
+#define PAGEINVA	((void *) 0x0fffe000)
+
 void
 serve_init(void)
 {
@@ -96,6 +107,25 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Note a read of n bytes of o at offset, before it is done.  If it
+// carries on where the last read left off, and misses the block cache,
+// read ahead a window of blocks, growing it for as long as the reads
+// stay sequential.  Any other read starts over.
+static void
+openfile_readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t window;
+
+	if (offset != o->o_ra_pos)
+		o->o_ra_window = 0;
+	else {
+		window = o->o_ra_window ? MIN(2 * o->o_ra_window, RA_MAX) : RA_MIN;
+		if (file_readahead(o->o_file, offset / BLKSIZE, window))
+			o->o_ra_window = window;
+	}
+	o->o_ra_pos = offset + n;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -164,6 +194,8 @@ try_open:
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
+	o->o_ra_pos = 0;
+	o->o_ra_window = 0;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
@@ -176,6 +208,29 @@ try_open:
 	return 0;
 }
 
+// Return the text cache's read-only copy of the page of
+// req->req_fileid at the page-aligned req->req_offset, to be mapped
+// into a spawned child in place of its own copy.
+int
+serve_map_text(envid_t envid, struct Fsreq_map_text *req,
+	       void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_map_text %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	if ((r = tcache_get(o->o_file, req->req_offset / BLKSIZE, pg_store)) < 0)
+		return r;
+	*perm_store = PTE_P|PTE_U;
+	return 0;
+}
+
 // Set the size of req->req_fileid to req->req_size bytes, truncating
 // or extending the file as necessary.
 int
@@ -220,6 +275,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		return r;
 	}
 
+	openfile_readahead(of,of->o_fd->fd_offset,req->req_n);
 	if((r=file_read(of->o_file,ret->ret_buf,req->req_n,of->o_fd->fd_offset)) < 0){
 		return r;
 	}
@@ -229,6 +285,113 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return r;
 }
 
+// Map the block cache's own page for the block of req->req_fileid at
+// the block-aligned req->req_offset to the caller, copy-on-write,
+// instead of copying the block like serve_read.  Only whole blocks of
+// the file are mapped, and not ones that clients have mapped shared
+// with mmap, whose later writes would show through.  Returns BLKSIZE,
+// or 0 with no page if the block can't be mapped, or < 0 on error.
+int
+serve_read_map(envid_t envid, struct Fsreq_read_map *req,
+	       void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	if (req->req_offset + BLKSIZE > o->o_file->f_size)
+		return 0;
+	openfile_readahead(o, req->req_offset, BLKSIZE);
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	if (va_is_shared(blk))
+		return 0;
+	if ((r = bc_snapshot(blk)) < 0)
+		return r;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_COW;
+	return BLKSIZE;
+}
+
+// Map the block cache's page for the block of req->req_fileid at the
+// block-aligned req->req_offset to the caller for mmap(MAP_SHARED),
+// writable if req->req_write is set.  The page stays shared, so that
+// the caller, the file server and other clients mapping it see each
+// other's writes.  The part of the file's last block past its end is
+// zeroed first.  A writable mapping can change the file without going
+// through us, so the file's pages in the text cache are dropped, as
+// for file_write.  Returns the number of bytes of the file in the
+// block, 0 with no page past the end of the file, or < 0 on error.
+int
+serve_mmap(envid_t envid, struct Fsreq_mmap *req,
+	   void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	struct File *f;
+	char *blk;
+	int n, r;
+
+	if (debug)
+		cprintf("serve_mmap %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	f = o->o_file;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	if (req->req_offset >= f->f_size)
+		return 0;
+	if ((r = file_get_block(f, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	n = MIN(BLKSIZE, f->f_size - req->req_offset);
+	if (n < BLKSIZE)
+		memset(blk + n, 0, BLKSIZE - n);
+	if ((r = bc_share(blk, req->req_write)) < 0)
+		return r;
+	if (req->req_write)
+		tcache_invalidate(f);
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_SHARE | (req->req_write ? PTE_W : 0);
+	return n;
+}
+
+// Write the page at fsreq, a whole block of data handed over by
+// FSREQ_WRITE_PAGE, to the file whose id is in req, at its seek
+// position, which must be block-aligned.  The page goes into the block
+// cache as it is.  Returns BLKSIZE, or < 0 on error.
+static int
+serve_write_page(envid_t envid, uint32_t req)
+{
+	struct OpenFile *o;
+	uint32_t fileid;
+	int r;
+
+	// Recover the top bits of the file id from its slot
+	fileid = req >> FSREQ_SHIFT;
+	o = &opentab[fileid % MAXOPEN];
+	if ((o->o_fileid << FSREQ_SHIFT) >> FSREQ_SHIFT != fileid)
+		return -E_INVAL;
+
+	if (debug)
+		cprintf("serve_write_page %08x %08x\n", envid, o->o_fileid);
+
+	if ((r = openfile_lookup(envid, o->o_fileid, &o)) < 0)
+		return r;
+	if ((r = file_write_block(o->o_file, o->o_fd->fd_offset, fsreq)) < 0)
+		return r;
+	o->o_fd->fd_offset += BLKSIZE;
+	return BLKSIZE;
+}
+
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -302,6 +465,14 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache's counters in ipc->cacheStatRet.
+int
+serve_cache_stat(envid_t envid, union Fsipc *ipc)
+{
+	bc_stat(&ipc->cacheStatRet);
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -312,41 +483,148 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_CACHE_STAT] =	serve_cache_stat
 };
 
+// Page in the page that 'envid' faulted on in one of its demand-paged
+// regions (see struct EnvRegion): read it from the file into a fresh
+// page and hand that over with sys_pagein.  Whole pages of read-only
+// regions come from the text cache instead, like FSREQ_MAP_TEXT.  The
+// kernel sends these requests on envid's behalf, without a request
+// page, and they get no reply.  If the page can't be read, envid is
+// killed.
+static void
+serve_pagein(envid_t envid)
+{
+	const volatile struct Env *e = &envs[ENVX(envid)];
+	struct EnvRegion rg;
+	struct OpenFile *o;
+	uintptr_t va, off;
+	void *pg;
+	int r;
+
+	if (e->env_id != envid || e->env_pagein_region < 0 ||
+	    e->env_pagein_region >= NENVREGION)
+		return;
+	rg = e->env_regions[e->env_pagein_region];
+	va = e->env_pagein_va;
+	off = va - rg.er_va;
+
+	if (debug)
+		cprintf("serve_pagein %08x %08x\n", envid, va);
+
+	if ((r = openfile_lookup(envid, rg.er_fileid, &o)) < 0)
+		goto fail;
+
+	// The text cache has whole file pages, which fit if the region
+	// has no zeroed part for them to show through
+	if (!(rg.er_perm & PTE_W) && rg.er_offset % BLKSIZE == 0 &&
+	    (off + PGSIZE <= rg.er_filesz || rg.er_filesz == rg.er_memsz)) {
+		if ((r = tcache_get(o->o_file, (rg.er_offset + off) / BLKSIZE, &pg)) == 0)
+			r = sys_pagein(envid, pg);
+		if (r >= 0 || r == -E_BAD_ENV)
+			return;
+		goto fail;
+	}
+
+	if ((r = sys_page_alloc(0, PAGEINVA, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	r = file_read(o->o_file, PAGEINVA, MIN(PGSIZE, rg.er_filesz - off),
+		      rg.er_offset + off);
+	if (r >= 0)
+		r = sys_pagein(envid, PAGEINVA);
+	sys_page_unmap(0, PAGEINVA);
+	// -E_BAD_ENV means envid is gone, or no longer waiting
+	if (r >= 0 || r == -E_BAD_ENV)
+		return;
+
+fail:
+	cprintf("serve_pagein %08x va %08x: %e\n", envid, va, r);
+	sys_pagein(envid, (void *) UTOP);
+}
+
+// Reply r, and pg with perm if pg is nonnull, to the client whom, as
+// ipc_reply_wait does, but without waiting for the next request.
+static void
+serve_reply(envid_t whom, int r, void *pg, int perm)
+{
+	int e;
+
+	e = sys_ipc_try_send(whom, r, pg ? pg : (void *) 0xFFFFFFFF, perm);
+	// The client may not be waiting for the reply yet, or be gone
+	if (e == -E_IPC_NOT_RECV)
+		ipc_send(whom, r, pg, perm);
+	else if (e < 0 && e != -E_BAD_ENV)
+		panic("serve_reply: %e", e);
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
+	unsigned deadline;
 	int perm, r;
 	void *pg;
 
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		if (req == IPC_PAGEIN) {
+			serve_pagein(whom);
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+			continue;
 		}
 
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP_TEXT) {
+			r = serve_map_text(whom, &fsreq->map_text, &pg, &perm);
+		} else if (req == FSREQ_READ_MAP) {
+			r = serve_read_map(whom, &fsreq->read_map, &pg, &perm);
+		} else if (req == FSREQ_MMAP) {
+			r = serve_mmap(whom, &fsreq->mmap, &pg, &perm);
+		} else if ((req & ((1 << FSREQ_SHIFT) - 1)) == FSREQ_WRITE_PAGE) {
+			r = serve_write_page(whom, req);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		// Reply and take the next request in one go.  The new
+		// request page replaces the old one at fsreq.
+		if ((deadline = bc_flush_deadline()) == ~0U) {
+			req = ipc_reply_wait(whom, r, pg, perm,
+					     (envid_t *) &whom, fsreq, &perm);
+			continue;
+		}
+
+		// With dirty blocks about, wait only until they are due
+		// to be written back, and write them back if no request
+		// comes first
+		serve_reply(whom, r, pg, perm);
+		req = ipc_recv_timeout((envid_t *) &whom, fsreq, &perm, deadline);
+		if (whom == 0 && (int32_t) req == -E_TIMEOUT) {
+			bc_sync();
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		}
 	}
 }
 
@@ -0,0 +1,122 @@
+/*
+ * Cache of read-only program text, shared across spawns.
+ *
+ * The first spawn of a program reads each read-only page of it into a
+ * page of its own here, and every later spawn of the same file maps
+ * that same page read-only into its child, instead of copying the
+ * text again.  The pages are copies, not the block cache's pages, so
+ * a running program doesn't change underneath when its file is
+ * written: the write just drops the file's pages from the cache, and
+ * the pages themselves go away with the last program mapping them.
+ */
+
+#include "fs.h"
+
+// Cached pages live in our address space at TCACHEVA + slot*PGSIZE.
+#define TCACHEVA	0xE0000000
+#define NTCACHE		512		// Most pages cached at once
+#define NTBUCKET	64		// Hash chains, keyed by file
+
+#define TSLOT2VA(i)	((void *) (TCACHEVA + (i) * PGSIZE))
+#define TBUCKET(f)	(((uintptr_t) (f) / sizeof(struct File)) % NTBUCKET)
+
+struct TPage {
+	struct File *tp_file;		// File the page is from, or NULL
+	uint32_t tp_filebno;		// Its block number in the file
+	int tp_next;			// Next slot on its chain, or -1
+};
+
+static struct TPage tpages[NTCACHE];
+static int tbuckets[NTBUCKET];		// First slot of each chain, or -1
+static int tfree;			// Free slots, chained by tp_next
+static int thand;			// Next slot to evict, round robin
+
+void
+tcache_init(void)
+{
+	int i;
+
+	for (i = 0; i < NTBUCKET; i++)
+		tbuckets[i] = -1;
+	for (i = 0; i < NTCACHE; i++) {
+		tpages[i].tp_file = NULL;
+		tpages[i].tp_next = i + 1 < NTCACHE ? i + 1 : -1;
+	}
+	tfree = 0;
+}
+
+// Unlink the cached page in 'slot' from its chain and drop it.
+// The caller puts the slot back on the free list, or reuses it.
+static void
+tcache_drop(int slot)
+{
+	int *p;
+
+	p = &tbuckets[TBUCKET(tpages[slot].tp_file)];
+	while (*p != slot)
+		p = &tpages[*p].tp_next;
+	*p = tpages[slot].tp_next;
+
+	sys_page_unmap(0, TSLOT2VA(slot));
+	tpages[slot].tp_file = NULL;
+}
+
+// Find the cached copy of block 'filebno' of 'f', reading it in if
+// it isn't cached yet, and store its address in *pg.  The part of
+// the page past the end of the file is zero.
+// Returns 0 on success, -E_INVAL if the block is past the end of the
+// file, or another error from reading it.
+int
+tcache_get(struct File *f, uint32_t filebno, void **pg)
+{
+	int b, i, r;
+
+	b = TBUCKET(f);
+	for (i = tbuckets[b]; i >= 0; i = tpages[i].tp_next)
+		if (tpages[i].tp_file == f && tpages[i].tp_filebno == filebno) {
+			*pg = TSLOT2VA(i);
+			return 0;
+		}
+
+	if (filebno >= (f->f_size + BLKSIZE - 1) / BLKSIZE)
+		return -E_INVAL;
+
+	if ((i = tfree) >= 0)
+		tfree = tpages[i].tp_next;
+	else {
+		i = thand;
+		thand = (thand + 1) % NTCACHE;
+		tcache_drop(i);
+	}
+
+	if ((r = sys_page_alloc(0, TSLOT2VA(i), PTE_P|PTE_U|PTE_W)) < 0 ||
+	    (r = file_read(f, TSLOT2VA(i), BLKSIZE, filebno * BLKSIZE)) < 0) {
+		sys_page_unmap(0, TSLOT2VA(i));
+		tpages[i].tp_next = tfree;
+		tfree = i;
+		return r;
+	}
+
+	tpages[i].tp_file = f;
+	tpages[i].tp_filebno = filebno;
+	tpages[i].tp_next = tbuckets[b];
+	tbuckets[b] = i;
+	*pg = TSLOT2VA(i);
+	return 0;
+}
+
+// Drop every cached page of 'f', whose contents are about to change.
+void
+tcache_invalidate(struct File *f)
+{
+	int i, next;
+
+	for (i = tbuckets[TBUCKET(f)]; i >= 0; i = next) {
+		next = tpages[i].tp_next;
+		if (tpages[i].tp_file == f) {
+			tcache_drop(i);
+			tpages[i].tp_next = tfree;
+			tfree = i;
+		}
+	}
+}
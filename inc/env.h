@@ -45,6 +45,26 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// A demand-paged region of an env's address space.  Pages in
+// [er_va, er_va + er_filesz) are filled in from a file by er_pager on
+// first touch; the rest, up to er_va + er_memsz, start out zero.
+struct EnvRegion {
+	uintptr_t er_va;		// Page-aligned start, or 0 if unused
+	size_t er_memsz;		// Size in memory
+	size_t er_filesz;		// Bytes of it that come from the file
+	off_t er_offset;		// File offset of er_va
+	int er_fileid;			// The pager's name for the file
+	envid_t er_pager;		// Env that reads the file for us
+	int er_perm;			// Permissions of the pages
+};
+
+#define NENVREGION		8
+
+// The value of the message the kernel sends a region's pager, from a
+// faulting env, for the page at env_pagein_va.  The pager answers
+// with sys_pagein.
+#define IPC_PAGEIN		0xFFFFFFFF
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -55,6 +75,13 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on a CPU run queue
+	struct Env *env_rq_prev;	// Previous env on a CPU run queue
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	unsigned env_wakeup;		// Deadline of a timed block, in msec
+	int env_sleep_idx;		// Index in the sleep heap, or -1
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
@@ -67,6 +94,30 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_waitfor;	// Only accept a send from this env, or 0
+
+	// Blocking IPC send
+	envid_t env_ipc_sendto;		// Env we're queued to send to, or 0
+	uint32_t env_ipc_send_value;	// The message we're waiting to send
+	void *env_ipc_send_srcva;
+	unsigned env_ipc_send_perm;
+	bool env_ipc_send_call;		// Wait for a reply once it's taken
+	bool env_ipc_send_pagein;	// Wait for sys_pagein once it's taken
+	struct Env *env_ipc_sendq_next;	// Next env queued with us
+	struct Env *env_ipc_sendq_prev;	// Previous env queued with us
+	struct Env *env_ipc_sendq_head;	// Envs queued to send to us
+	struct Env *env_ipc_sendq_tail;
+	struct Env *env_pagein_head;	// Envs whose IPC_PAGEIN we've taken
+
+	// Device interrupts, see sys_irq_wait
+	uint32_t env_irq_pending;	// IRQs that fired since we last waited
+	uint32_t env_irq_wait;		// IRQs we're blocked waiting for
+
+	// Demand paging
+	struct EnvRegion env_regions[NENVREGION];
+	int env_pagein_region;		// Region we wait on a page of, or -1
+	envid_t env_pagein_pager;	// Pager that took our IPC_PAGEIN, or 0
+	uintptr_t env_pagein_va;	// The page we wait for
 };
 
 #endif // !JOS_INC_ENV_H
@@ -26,6 +26,7 @@ enum {
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
 	E_DEVICE_BUSY, // Device is busy (means some queues of the device are full)
+	E_TIMEOUT	,	// Deadline passed before the operation completed
 
 	MAXERROR
 };
@@ -70,9 +70,26 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map text returns a shared read-only page of the file
+	FSREQ_MAP_TEXT,
+	// Read map returns the block cache's page of a whole block
+	FSREQ_READ_MAP,
+	// Write page sends a whole block to write in place of a request
+	// page, see FSREQ_WRITE_PAGE_REQ
+	FSREQ_WRITE_PAGE,
+	// Mmap returns the block cache's page of a block, shared
+	FSREQ_MMAP,
+	// Cache stat returns a Fsret_cache_stat on the request page
+	FSREQ_CACHE_STAT
 };
 
+// FSREQ_WRITE_PAGE has no request page for its arguments, so the file
+// id rides in the IPC value above the request code, less its top bits.
+#define FSREQ_SHIFT	8
+#define FSREQ_WRITE_PAGE_REQ(fileid) \
+	(FSREQ_WRITE_PAGE | (uint32_t) (fileid) << FSREQ_SHIFT)
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -108,6 +125,26 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map_text {
+		int req_fileid;
+		off_t req_offset;
+	} map_text;
+	struct Fsreq_read_map {
+		int req_fileid;
+		off_t req_offset;
+	} read_map;
+	struct Fsreq_mmap {
+		int req_fileid;
+		off_t req_offset;
+		int req_write;
+	} mmap;
+	struct Fsret_cache_stat {
+		uint32_t ret_hits;	// Lookups of blocks that were cached
+		uint32_t ret_misses;	// Blocks read in from disk
+		uint32_t ret_evictions;	// Blocks dropped to make room
+		uint32_t ret_nblocks;	// Blocks cached now
+		uint32_t ret_maxblocks;	// Most blocks cached at once
+	} cacheStatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
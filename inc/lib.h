@@ -44,12 +44,14 @@ void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 char*	readline(const char *buf);
 
 // syscall.c
+extern bool sysenter_enabled;
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
@@ -57,9 +59,29 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+		envid_t dst_env, void *dst_va, size_t len, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t len);
+int	sys_page_batch(const struct PageOp *ops, int n);
+int	sys_env_add_region(envid_t env, const struct EnvRegion *rg);
+int	sys_pagein(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_timeout(void *rcv_pg, unsigned int deadline);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
 unsigned int sys_time_msec(void);
+int	sys_sleep_until(unsigned int msec);
+int	sys_irq_wait(unsigned int irq, unsigned int deadline);
+int	sys_page_physaddr(void *va);
+int	sys_ide_dma_base(void);
+int	sys_blk_probe(void);
+int	sys_blk_submit(uint32_t secno, void *va, size_t nsecs, bool write);
+int	sys_blk_poll(int tag);
 
 int sys_transmit_packet(void* addr,int len);
 int sys_try_receive_packet(void* buf);
@@ -78,10 +100,15 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 unsigned int deadline);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -101,6 +128,11 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_cache_stat(struct Fsret_cache_stat *st);
+int	file_map_text(int fd, off_t offset, void *dstva);
+int	file_read_map(int fd, off_t offset, void *dstva);
+void*	mmap(int fd, off_t offset, size_t len, int prot, int flags);
+int	munmap(void *addr, size_t len);
 
 // pageref.c
 int	pageref(void *addr);
@@ -127,6 +159,7 @@ int     nsipc_socket(int domain, int type, int protocol);
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
+envid_t	spawn_lazy(const char *program, const char **argv);
 
 // console.c
 void	cputchar(int c);
@@ -152,4 +185,13 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections and flags */
+#define	PROT_READ	0x0001		/* pages can be read */
+#define	PROT_WRITE	0x0002		/* pages can be written */
+
+#define	MAP_SHARED	0x0001		/* share changes with the file */
+#define	MAP_PRIVATE	0x0002		/* changes are private */
+
+#define	MAP_FAILED	((void *) -1)
+
 #endif	// !JOS_INC_LIB_H
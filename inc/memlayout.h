@@ -184,8 +184,9 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous page on the free list.
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -193,6 +194,10 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// If this page heads a free block of 2^pp_order pages, the block's
+	// order; otherwise -1.
+	int8_t pp_order;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -1,6 +1,9 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+#include <inc/mmu.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,7 +23,45 @@ enum {
 	SYS_time_msec,
 	SYS_transmit_packet,
 	SYS_try_receive_packet,
+	SYS_sleep_until,
+	SYS_ipc_recv_timeout,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_send,
+	SYS_fork,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_page_batch,
+	SYS_env_add_region,
+	SYS_pagein,
+	SYS_irq_wait,
+	SYS_page_physaddr,
+	SYS_ide_dma_base,
+	SYS_blk_probe,
+	SYS_blk_submit,
+	SYS_blk_poll,
 	NSYSCALLS
 };
 
+/* operations for sys_page_batch */
+enum {
+	PAGEOP_ALLOC = 0,	/* sys_page_alloc_range(dstenv, dstva, len, perm) */
+	PAGEOP_MAP,		/* sys_page_map_range(srcenv, srcva, dstenv, dstva, len, perm) */
+	PAGEOP_UNMAP,		/* sys_page_unmap_range(dstenv, dstva, len) */
+};
+
+struct PageOp {
+	uint32_t op;
+	int32_t srcenv;		/* envid_t; PAGEOP_MAP only */
+	uintptr_t srcva;
+	int32_t dstenv;		/* envid_t */
+	uintptr_t dstva;
+	size_t len;		/* bytes, a multiple of PGSIZE */
+	int perm;
+};
+
+// At most this many operations, which fit in one page, per sys_page_batch.
+#define PAGEOP_MAX	(PGSIZE / sizeof(struct PageOp))
+
 #endif /* !JOS_INC_SYSCALL_H */
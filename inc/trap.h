@@ -36,8 +36,12 @@
 #define IRQ_KBD          1
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
+#define IRQ_PCI_FIRST    9	// PCI devices get one of these from the BIOS
+#define IRQ_PCI_LAST    11
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20	// IPI: work was queued for a halted CPU
+#define IRQ_TLB         21	// IPI: flush TLB entries, see tlb_shootdown()
 
 #ifndef __ASSEMBLER__
 
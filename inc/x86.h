@@ -240,6 +240,22 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// cpuid(1) %edx feature flags
+#define CPUID_PSE	(1 << 3)	// 4MB pages
+#define CPUID_SEP	(1 << 11)	// SYSENTER/SYSEXIT
+#define CPUID_PGE	(1 << 13)	// Global pages
+
+// Model-specific registers
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint64_t
 read_tsc(void)
 {
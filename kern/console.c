@@ -9,6 +9,7 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -398,6 +399,16 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// cons_lock serializes the console devices and the input buffer.
+// cprintf() holds it for a whole message so that output from
+// different CPUs doesn't interleave.
+struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock",
+	.rank = LOCK_RANK_CONSOLE
+#endif
+};
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
@@ -405,6 +416,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -412,6 +424,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -427,13 +440,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
@@ -462,6 +477,15 @@ cons_init(void)
 
 void
 cputchar(int c)
+{
+	spin_lock(&cons_lock);
+	cons_putc(c);
+	spin_unlock(&cons_lock);
+}
+
+// Like cputchar, for callers that already hold cons_lock.
+void
+cputchar_locked(int c)
 {
 	cons_putc(c);
 }
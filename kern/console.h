@@ -17,8 +17,11 @@
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
+extern struct spinlock cons_lock;
+
 void cons_init(void);
 int cons_getc(void);
+void cputchar_locked(int c);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
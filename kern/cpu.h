@@ -10,6 +10,20 @@
 // Maximum number of CPUs
 #define NCPU  8
 
+// Per-CPU page magazines, see page_alloc() in kern/pmap.c
+#define PAGE_MAG_SIZE	64		// Pages a CPU may cache
+#define PAGE_MAG_BATCH	32		// Pages moved per refill or drain
+
+// Pages unmapped but maybe still in another CPU's TLB, whose
+// references are dropped once it is flushed; see kern/pmap.c
+#define TLB_FREE_MAX	32
+
+struct TlbFree {
+	pde_t *tf_pgdir;		// Address space it was unmapped from
+	void *tf_va;			// Where it was mapped
+	struct PageInfo *tf_page;
+};
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -23,6 +37,35 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+
+	// Run queue of ENV_RUNNABLE environments, see kern/sched.c
+	struct Env *cpu_rq_head;        // Next environment to run
+	struct Env *cpu_rq_tail;        // Most recently queued environment
+	unsigned cpu_rq_len;            // Number of queued environments
+	uint32_t cpu_rq_steals;         // Environments stolen from other CPUs
+
+	// Magazine of free pages, a LIFO stack, see kern/pmap.c
+	struct PageInfo *cpu_pages[PAGE_MAG_SIZE];
+	int cpu_npages;                 // Pages in cpu_pages
+	uint32_t cpu_page_hits;         // Allocs and frees done without page_lock
+	uint32_t cpu_page_refills;      // Batches taken from the buddy lists
+	uint32_t cpu_page_drains;       // Batches returned to the buddy lists
+	uint32_t cpu_zero_hits;         // ALLOC_ZERO pages taken pre-zeroed
+	uint32_t cpu_zero_misses;       // ALLOC_ZERO pages zeroed on demand
+	uint32_t cpu_zero_fills;        // Pages zeroed for the pool while idle
+
+	// Address space loaded in CR3, see pgdir_load() in kern/pmap.c
+	physaddr_t cpu_cr3;             // Physical address of the loaded pgdir
+	uint32_t cpu_env_runs;          // Calls to env_run
+	uint32_t cpu_cr3_loads;         // CR3 reloads, each flushing the TLB
+
+	// TLB shootdowns, see tlb_shootdown() in kern/pmap.c
+	struct TlbFree cpu_tlb_free[TLB_FREE_MAX];
+	int cpu_ntlb_free;              // Entries in cpu_tlb_free
+	uint32_t cpu_tlb_shootdowns;    // Rounds of IPIs sent
+	uint32_t cpu_tlb_ipis;          // IPIs sent in those rounds
+	uint64_t cpu_tlb_cycles;        // TSC cycles spent waiting for them
+	uint32_t cpu_tlb_remote;        // Flushes done for other CPUs
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +85,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_calibrate(uint32_t *tsc_per_ms);
+void lapic_timer_oneshot(uint32_t usec);
 
 #endif
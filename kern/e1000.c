@@ -1,5 +1,6 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 #include <inc/string.h>
 
 // LAB 6: Your driver code here
@@ -11,6 +12,21 @@ struct e1000_tx_desc* tdrs;
 // An array of all RDR
 struct e1000_rx_desc* rdrs;
 
+// Each ring has its own lock, so a CPU sending doesn't wait for one receiving
+static struct spinlock e1000_tx_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "e1000_tx_lock",
+    .rank = LOCK_RANK_E1000
+#endif
+};
+
+static struct spinlock e1000_rx_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "e1000_rx_lock",
+    .rank = LOCK_RANK_E1000
+#endif
+};
+
 // Write 4-byte data to certain reg of e1000
 // The offset specified what reg to write
 void inline e1000_reg_writel(int offset,uint32_t val){
@@ -37,12 +53,25 @@ uint32_t inline read_rdt(){
 }
 
 
+static int e1000_try_receive_data_locked(void* buf);
+
 // Try to receive a packer from e1000 device (It may fail if there is no packet to receive)
 // If there is a packet to receive, then the data will be copied to the address given by parameter buf
 // MUST make sure the length of buf at least equal to E1000_RD_BUFFER_SIZE
 // Return the length of data, if succeeded
 // Return -ERROR_RDR_EMPTY if there is no packet to receive
 int e1000_try_receive_data(void* buf){
+    int r;
+
+    spin_lock(&e1000_rx_lock);
+    r=e1000_try_receive_data_locked(buf);
+    spin_unlock(&e1000_rx_lock);
+
+    return r;
+}
+
+// The body of e1000_try_receive_data, called with e1000_rx_lock held
+static int e1000_try_receive_data_locked(void* buf){
     // It will check the DD status of the next element of RDT, if it's set, then there is packet to receive
     // When finish copy, it will clear DD status and move RDT forward
 
@@ -114,28 +143,23 @@ void e1000_receive_init(){
     e1000_reg_writel(E1000_RDLEN,E1000_RDR_SIZE);
 
     // Step 3
-    // Make sure buffer size a factor of PGSIZE
-    assert(PGSIZE % E1000_RD_BUFFER_SIZE == 0);
-
-    int page_per_rd = PGSIZE / E1000_RD_BUFFER_SIZE;
-    int pages=ROUNDUP(E1000_RD_NUM,page_per_rd);
-
-    int current_rd_index=0;
-    for(int i=0;i<pages;i++){
-        pp = page_alloc(ALLOC_ZERO);
-        if(pp == NULL){
-            panic("No free page for RD buffer");
-        }
-
-        // Assign address for each rd
-        physaddr_t base_pa=page2pa(pp);
-        for(int j=0;j<page_per_rd;j++){
-            rdrs[current_rd_index].buffer_addr = (uint64_t)(base_pa + j * E1000_RD_BUFFER_SIZE);
-            // Also, clear the DD status flag
-            rdrs[current_rd_index].status = 0;
-
-            current_rd_index++;
-        }
+    // All RD buffers come from one physically contiguous block
+    int order=0;
+    while((PGSIZE << order) < E1000_RD_NUM * E1000_RD_BUFFER_SIZE){
+        order++;
+    }
+
+    pp = page_alloc_order(order,ALLOC_ZERO);
+    if(pp == NULL){
+        panic("No free block for RD buffers");
+    }
+
+    // Assign address for each rd
+    physaddr_t base_pa=page2pa(pp);
+    for(int i=0;i<E1000_RD_NUM;i++){
+        rdrs[i].buffer_addr = (uint64_t)(base_pa + i * E1000_RD_BUFFER_SIZE);
+        // Also, clear the DD status flag
+        rdrs[i].status = 0;
     }
 
     // Step 4.
@@ -224,10 +248,13 @@ int e1000_transmit_data(physaddr_t addr,int len){
         return -ERROR_INVALID_LENGTH;
     }
 
+    spin_lock(&e1000_tx_lock);
+
     // Allocate a TD
     struct e1000_tx_desc* td=td_alloc();
     if(td == NULL){
         // No free TD
+        spin_unlock(&e1000_tx_lock);
         return -ERROR_NO_FREE_TD;
     }
 
@@ -243,6 +270,8 @@ int e1000_transmit_data(physaddr_t addr,int len){
     // Move forward the TDT
     forward_tdt();
 
+    spin_unlock(&e1000_tx_lock);
+
     return TD_INDEX(td);
 }
 
@@ -6,7 +6,6 @@
 #define JOS_KERN_E1000_H
 
 // The size of each RD buffer (in bytes)
-// For convenience, it must be a factor of PGSIZE
 #define E1000_RD_BUFFER_SIZE 2048
 #define E1000_RCTL_BSIZE_2048 (00 << 16)
 
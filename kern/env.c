@@ -14,10 +14,38 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/virtio.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+unsigned env_nactive;			// Envs RUNNABLE, RUNNING or DYING
+
+// Protects env_free_list
+static struct spinlock env_table_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_table_lock",
+	.rank = LOCK_RANK_ENV_TABLE
+#endif
+};
+
+// Per-Env locks, indexed like envs[].  env_locks[i] protects envs[i]'s
+// env_status, its env_ipc_* fields and its address space against
+// changes made from other CPUs.  See env_lock().
+static struct spinlock env_locks[NENV];
+
+// Envs blocked in sys_ipc_send() wait on a FIFO queue hanging off the
+// env they are sending to, doubly linked through env_ipc_sendq_next/prev.
+// A queued env is ENV_NOT_RUNNABLE, with env_ipc_sendto set to the id of
+// the env whose queue it is on.  sendq_lock protects every queue and
+// env_ipc_sendto.  Queueing on an env also requires that env's lock, so
+// an env holding its own lock sees no new senders arrive.
+struct spinlock sendq_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sendq_lock",
+	.rank = LOCK_RANK_SENDQ
+#endif
+};
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -108,6 +136,163 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Acquire e's lock.  Per-Env locks all share one rank, so a CPU that
+// needs two of them must use env_lock2().
+//
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+//
+// Acquire the locks of a and b (which may be the same env) in
+// address order, so that two CPUs locking the same pair can't deadlock.
+//
+void
+env_lock2(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_lock(a);
+	} else if (a < b) {
+		env_lock(a);
+		env_lock(b);
+	} else {
+		env_lock(b);
+		env_lock(a);
+	}
+}
+
+void
+env_unlock2(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
+//
+// envid2env() looks e up without its lock, so by the time the caller
+// has locked e it may have been freed or even reused.  With e's lock
+// held, return true if e is still the env whose id was 'id'.
+//
+bool
+env_is_live(struct Env *e, envid_t id)
+{
+	return e->env_status != ENV_FREE && e->env_id == id;
+}
+
+//
+// Queue s at the tail of target's send queue.  The caller must hold
+// sendq_lock and the locks of both envs.
+//
+void
+env_sendq_push(struct Env *target, struct Env *s)
+{
+	assert(s->env_ipc_sendto == 0);
+
+	s->env_ipc_sendto = target->env_id;
+	s->env_ipc_sendq_next = NULL;
+	s->env_ipc_sendq_prev = target->env_ipc_sendq_tail;
+	if (target->env_ipc_sendq_tail)
+		target->env_ipc_sendq_tail->env_ipc_sendq_next = s;
+	else
+		target->env_ipc_sendq_head = s;
+	target->env_ipc_sendq_tail = s;
+}
+
+//
+// Take s off the send queue it is on, if any.
+// The caller must hold sendq_lock.
+//
+void
+env_sendq_remove(struct Env *s)
+{
+	struct Env *target;
+
+	if (s->env_ipc_sendto == 0)
+		return;
+	target = &envs[ENVX(s->env_ipc_sendto)];
+
+	if (s->env_ipc_sendq_prev)
+		s->env_ipc_sendq_prev->env_ipc_sendq_next = s->env_ipc_sendq_next;
+	else
+		target->env_ipc_sendq_head = s->env_ipc_sendq_next;
+	if (s->env_ipc_sendq_next)
+		s->env_ipc_sendq_next->env_ipc_sendq_prev = s->env_ipc_sendq_prev;
+	else
+		target->env_ipc_sendq_tail = s->env_ipc_sendq_prev;
+
+	s->env_ipc_sendq_next = s->env_ipc_sendq_prev = NULL;
+	s->env_ipc_sendto = 0;
+}
+
+//
+// Put s, whose IPC_PAGEIN message pager has taken, on pager's list of
+// envs waiting for its sys_pagein.  s has left any send queue, so the
+// list reuses the send queue links.  The caller must hold sendq_lock
+// and the locks of both envs.
+//
+void
+env_pagein_push(struct Env *pager, struct Env *s)
+{
+	assert(s->env_ipc_sendto == 0 && s->env_pagein_pager == 0);
+
+	s->env_pagein_pager = pager->env_id;
+	s->env_ipc_sendq_prev = NULL;
+	s->env_ipc_sendq_next = pager->env_pagein_head;
+	if (pager->env_pagein_head)
+		pager->env_pagein_head->env_ipc_sendq_prev = s;
+	pager->env_pagein_head = s;
+}
+
+//
+// Take s off the pager's list it is on, if any.
+// The caller must hold sendq_lock.
+//
+void
+env_pagein_remove(struct Env *s)
+{
+	struct Env *pager;
+
+	if (s->env_pagein_pager == 0)
+		return;
+	pager = &envs[ENVX(s->env_pagein_pager)];
+
+	if (s->env_ipc_sendq_prev)
+		s->env_ipc_sendq_prev->env_ipc_sendq_next = s->env_ipc_sendq_next;
+	else
+		pager->env_pagein_head = s->env_ipc_sendq_next;
+	if (s->env_ipc_sendq_next)
+		s->env_ipc_sendq_next->env_ipc_sendq_prev = s->env_ipc_sendq_prev;
+
+	s->env_ipc_sendq_next = s->env_ipc_sendq_prev = NULL;
+	s->env_pagein_pager = 0;
+}
+
+//
+// Return true if e is ENV_RUNNING on this CPU.  An env that blocked
+// here may meanwhile have been woken and picked up by another CPU, so
+// its status alone doesn't say whether this CPU may resume it.
+//
+bool
+env_running_here(struct Env *e)
+{
+	bool r;
+
+	env_lock(e);
+	r = e->env_status == ENV_RUNNING && e->env_cpunum == cpunum();
+	env_unlock(e);
+	return r;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -121,6 +306,15 @@ env_init(void)
 	// LAB 3: Your code here.
 	struct Env* current=envs;
 	env_free_list=envs;
+	for(int i=0;i<NENV;i++){
+		envs[i].env_status=ENV_FREE;
+		envs[i].env_rq_cpu=-1;
+		envs[i].env_sleep_idx=-1;
+		spin_initlock(&env_locks[i],LOCK_RANK_ENV);
+		envs[i].env_ipc_sendq_head=envs[i].env_ipc_sendq_tail=NULL;
+		envs[i].env_pagein_head=NULL;
+		envs[i].env_pagein_pager=0;
+	}
 	for(int i=1;i<NENV;i++){
 		current->env_link=&envs[i];
 		current=&envs[i];
@@ -223,12 +417,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -239,7 +443,6 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -272,9 +475,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_ipc_waitfor = 0;
+	e->env_ipc_sendto = 0;
+
+	// No interrupts until it waits for some.
+	e->env_irq_pending = 0;
+	e->env_irq_wait = 0;
+
+	// No demand-paged regions until the creator adds some.
+	memset(e->env_regions, 0, sizeof(e->env_regions));
+	e->env_pagein_region = -1;
+
+	// commit the allocation.  The new env stays ENV_NOT_RUNNABLE until
+	// its creator has finished setting it up, so that no other CPU can
+	// pick it up half-initialized.
+	env_lock(e);
+	env_set_status(e, ENV_NOT_RUNNABLE);
+	env_unlock(e);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -472,10 +689,15 @@ env_create(uint8_t *binary, enum EnvType type)
 	
 
 	load_icode(e,binary);
+
+	env_lock(e);
+	env_set_status(e,ENV_RUNNABLE);
+	env_unlock(e);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold e's lock.
 //
 void
 env_free(struct Env *e)
@@ -483,12 +705,38 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct Env *s;
+
+	// Leave any send queue e is on.  Envs still queued to send to e
+	// wake at the next reschedule, as though from an expired sleep,
+	// and fail with the -E_BAD_ENV they set up before blocking.
+	// Envs whose page-in request e had taken wake the same way, to
+	// fault again and find their pager gone.  Everything on these
+	// lists is blocked: whatever makes it runnable takes it off first.
+	spin_lock(&sendq_lock);
+	env_sendq_remove(e);
+	env_pagein_remove(e);
+	while ((s = e->env_ipc_sendq_head) != NULL) {
+		env_sendq_remove(s);
+		sched_sleep(s, 0);
+	}
+	while ((s = e->env_pagein_head) != NULL) {
+		env_pagein_remove(s);
+		s->env_pagein_region = -1;
+		sched_sleep(s, 0);
+	}
+	spin_unlock(&sendq_lock);
+
+	// Only an env with I/O privilege can have virtio disk requests.
+	// Those still in flight keep their pages until the disk is done.
+	if ((e->env_tf.tf_eflags & FL_IOPL_MASK) == FL_IOPL_3)
+		virtio_blk_env_free(e->env_id);
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_load(kern_pgdir);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -501,15 +749,22 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
+		// unmap all PTEs in this page table, with one TLB flush
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				page_remove_noinval(e->env_pgdir, PGADDR(pdeno, pteno, 0));
 		}
+		tlb_flush(e->env_pgdir);
 
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
@@ -522,9 +777,11 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -535,15 +792,25 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	env_lock(e);
+
+	// Someone else got here first.
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING) {
+		env_unlock(e);
+		return;
+	}
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// its CPU enters the scheduler.
+	if (e->env_status == ENV_RUNNING && e->env_cpunum != cpunum()) {
+		env_set_status(e, ENV_DYING);
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -552,6 +819,54 @@ env_destroy(struct Env *e)
 }
 
 
+//
+// Change e's env_status, keeping the scheduler's run queues in step:
+// an env is on exactly one CPU run queue while it is ENV_RUNNABLE,
+// and on none otherwise.  Leaving ENV_NOT_RUNNABLE also cancels a
+// timed block (see sched_sleep()).  All env_status writes go through here,
+// with e's lock held.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	bool was_active, is_active;
+
+	if (e->env_status == status)
+		return;
+
+	// Once e stops running here and its lock is dropped, another CPU
+	// may run or free it, so stop using its page directory now.
+	if (e == curenv && status != ENV_RUNNING && status != ENV_DYING &&
+	    thiscpu->cpu_cr3 == PADDR(e->env_pgdir))
+		pgdir_load(kern_pgdir);
+
+	spin_lock(&sched_lock);
+
+	was_active = e->env_status == ENV_RUNNABLE ||
+		e->env_status == ENV_RUNNING || e->env_status == ENV_DYING;
+	is_active = status == ENV_RUNNABLE ||
+		status == ENV_RUNNING || status == ENV_DYING;
+
+	if (e->env_status == ENV_RUNNABLE)
+		sched_dequeue(e);
+
+	e->env_status = status;
+
+	if (status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	if (e->env_sleep_idx >= 0 && status != ENV_NOT_RUNNABLE)
+		sched_unsleep(e);
+
+	if (status == ENV_RUNNING)
+		e->env_cpunum = cpunum();
+
+	if (!was_active && is_active)
+		env_nactive++;
+	else if (was_active && !is_active)
+		env_nactive--;
+	spin_unlock(&sched_lock);
+}
+
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -564,8 +879,6 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
-	unlock_kernel();
-
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
@@ -604,21 +917,38 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	
-	if(curenv != NULL && curenv->env_status == ENV_RUNNING){
-		//No need to save registers, it is saved when interrupt
-		curenv->env_status=ENV_RUNNABLE;
-		curenv->env_runs--;
-	}
+
+	//The caller has already made e ENV_RUNNING on this CPU,
+	//either by claiming it in sched_yield or because it is curenv
+	struct Env* prev=curenv;
 
 	curenv=e;
-	e->env_status=ENV_RUNNING;
-	e->env_runs++;
+	//Only count real switches, resuming the same env doesn't count
+	if(prev != e)
+		e->env_runs++;
 
 	//Unmask interrupt
 	// e->env_tf.tf_eflags |= FL_IF;
 
-	lcr3((uint32_t)PADDR(e->env_pgdir));
+	//Returning to the env that trapped leaves its pgdir in CR3, so
+	//don't throw away its TLB entries by loading it again
+	thiscpu->cpu_env_runs++;
+	pgdir_load(e->env_pgdir);
+
+	//Put the previous env back on a run queue, unless it blocked
+	//or was destroyed meanwhile.  This is done after the CR3 load so that
+	//another CPU can pick it up while we no longer use its pgdir.
+	//A zombie left behind by a direct IPC handoff is reaped here.
+	if(prev != NULL && prev != e){
+		//No need to save registers, it is saved when interrupt
+		env_lock(prev);
+		if(prev->env_status == ENV_RUNNING && prev->env_cpunum == cpunum()){
+			env_set_status(prev,ENV_RUNNABLE);
+		}else if(prev->env_status == ENV_DYING && prev->env_cpunum == cpunum()){
+			env_free(prev);
+		}
+		env_unlock(prev);
+	}
 
 	env_pop_tf(&e->env_tf);
 }
@@ -7,6 +7,7 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern unsigned env_nactive;		// Envs RUNNABLE, RUNNING or DYING
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -16,6 +17,19 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock2(struct Env *a, struct Env *b);
+void	env_unlock2(struct Env *a, struct Env *b);
+bool	env_is_live(struct Env *e, envid_t id);
+bool	env_running_here(struct Env *e);
+
+extern struct spinlock sendq_lock;
+void	env_sendq_push(struct Env *target, struct Env *s);
+void	env_sendq_remove(struct Env *s);
+void	env_pagein_push(struct Env *pager, struct Env *s);
+void	env_pagein_remove(struct Env *s);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -19,6 +19,10 @@
 
 static void boot_aps(void);
 
+// Set once the boot CPU has created the initial environments; APs
+// wait for it before entering the scheduler.
+static volatile uint32_t envs_ready;
+
 
 void
 i386_init(void)
@@ -47,10 +51,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
 	// Starting non-boot CPUs
 	boot_aps();
 
@@ -75,6 +75,9 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Let the APs start scheduling
+	xchg(&envs_ready, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -115,8 +118,13 @@ boot_aps(void)
 void
 mp_main(void)
 {
-	// We are in high EIP now, safe to switch to kern_pgdir 
+	// We are in high EIP now, safe to switch to kern_pgdir, once
+	// this CPU can read its 4MB pages.  The raw load comes first:
+	// pgdir_load() finds thiscpu through the LAPIC, which entry_pgdir
+	// doesn't map.  It then records kern_pgdir as loaded.
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -124,12 +132,11 @@ mp_main(void)
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
-	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// Now that we have finished some basic setup, wait for the
+	// boot CPU to create the initial environments and then call
+	// sched_yield() to start running processes on this CPU.
+	while (!envs_ready)
+		asm volatile ("pause");
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
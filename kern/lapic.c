@@ -42,9 +42,19 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// PIT channel 2, used only to calibrate the timer and the TSC
+#define PIT_FREQ	1193182      // Input clock, in Hz
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61         // Bit 0: ch. 2 gate, bit 1: speaker,
+                                     // bit 5: ch. 2 output
+#define CAL_MS		10           // Length of the calibration run
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+static uint32_t lapic_ticks_per_ms;	// Timer counts per ms, see lapic_timer_calibrate
+
 static void
 lapicw(int index, int value)
 {
@@ -65,13 +75,12 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It starts stopped; the kernel
+	// arms it for its next deadline with lapic_timer_oneshot().
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -127,6 +136,63 @@ lapic_eoi(void)
 		lapicw(EOI, 0);
 }
 
+// Measure the timer's and the TSC's rates against PIT channel 2, which
+// ticks at a known PIT_FREQ.  Called once, on the boot CPU; the other
+// CPUs share the bus clock.  Stores TSC ticks per ms in *tsc_per_ms.
+void
+lapic_timer_calibrate(uint32_t *tsc_per_ms)
+{
+	uint32_t latch = PIT_FREQ / 1000 * CAL_MS;
+	uint32_t count = 0;
+	uint64_t tsc;
+	uint8_t gate;
+
+	// Gate channel 2 on with the speaker off, and start it in mode 0
+	// (interrupt on terminal count): its output goes high when the
+	// count runs out.
+	gate = inb(PIT_GATE);
+	outb(PIT_GATE, (gate & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xB0);
+	outb(PIT_CH2, latch & 0xFF);
+	outb(PIT_CH2, latch >> 8);
+
+	if (lapic) {
+		lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+		lapicw(TICR, 0xFFFFFFFF);
+		count = lapic[TCCR];
+	}
+	tsc = read_tsc();
+
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+
+	*tsc_per_ms = (read_tsc() - tsc) / CAL_MS;
+	if (lapic) {
+		lapic_ticks_per_ms = (count - lapic[TCCR]) / CAL_MS;
+		lapicw(TICR, 0);
+		lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	}
+	outb(PIT_GATE, gate);
+}
+
+// Make this CPU's timer interrupt once, usec microseconds from now,
+// replacing any earlier deadline.  usec == 0 stops the timer.
+void
+lapic_timer_oneshot(uint32_t usec)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+
+	count = (uint64_t)usec * lapic_ticks_per_ms / 1000;
+	if (usec && count == 0)
+		count = 1;
+	if (count > 0xFFFFFFFF)
+		count = 0xFFFFFFFF;	// Fires early; the kernel rearms it
+	lapicw(TICR, count);
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 static void
@@ -173,6 +239,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send an IPI to the CPU whose local APIC ID is apicid.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -11,6 +11,8 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,7 +27,9 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
-	{"backtrace", "DO backtrace", mon_backtrace}
+	{"backtrace", "DO backtrace", mon_backtrace},
+	{"buddyinfo", "Display free physical memory blocks by order, and the per-CPU page caches", mon_buddyinfo},
+	{"tlbinfo", "Display per-CPU CR3 loads and TLB shootdowns", mon_tlbinfo}
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -56,6 +60,50 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t n, total = 0;
+	struct CpuInfo *c;
+	int order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		n = page_nfree(order);
+		cprintf("order %2d (%5dKB blocks): %d free\n",
+			order, (PGSIZE << order) / 1024, n);
+		total += n << order;
+	}
+	cprintf("%d pages (%dKB) free\n", total, total * PGSIZE / 1024);
+	cprintf("%d pages zeroed in advance\n", page_nzero());
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("CPU %d: %d pages cached, %u hits, %u refills, %u drains\n",
+			c - cpus, c->cpu_npages, c->cpu_page_hits,
+			c->cpu_page_refills, c->cpu_page_drains);
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("CPU %d: %u zeroed pages taken, %u zeroed on demand, %u zeroed while idle\n",
+			c - cpus, c->cpu_zero_hits, c->cpu_zero_misses,
+			c->cpu_zero_fills);
+	return 0;
+}
+
+int
+mon_tlbinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("CPU %d: %u env runs, %u CR3 loads\n",
+			c - cpus, c->cpu_env_runs, c->cpu_cr3_loads);
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("CPU %d: %u shootdowns, %u IPIs, %u cycles avg wait, %u flushes for others\n",
+			c - cpus, c->cpu_tlb_shootdowns, c->cpu_tlb_ipis,
+			c->cpu_tlb_shootdowns ?
+			(uint32_t) (c->cpu_tlb_cycles / c->cpu_tlb_shootdowns) : 0,
+			c->cpu_tlb_remote);
+	return 0;
+}
+
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
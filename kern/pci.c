@@ -4,6 +4,7 @@
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/e1000.h>
+#include <kern/virtio.h>
 #include <kern/pmap.h>
 
 // Flag to do "lspci" at bootup
@@ -16,6 +17,11 @@ static uint32_t pci_conf1_data_ioport = 0x0cfc;
 
 // Forward declarations
 static int pci_bridge_attach(struct pci_func *pcif);
+static int pci_ide_attach(struct pci_func *pcif);
+
+// I/O base of the bus-master registers of the IDE controller, for the
+// file server's DMA driver, or 0 if no controller can do DMA
+uint32_t pci_ide_bmbase;
 
 // PCI driver table
 struct pci_driver {
@@ -26,6 +32,7 @@ struct pci_driver {
 // pci_attach_class matches the class and subclass of a PCI device
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &pci_ide_attach },
 	{ 0, 0, 0 },
 };
 
@@ -33,6 +40,7 @@ struct pci_driver pci_attach_class[] = {
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
 	{ 0x8086, 0x100E, &e1000_attach },
+	{ 0x1AF4, 0x1001, &virtio_blk_attach },
 	{ 0, 0, 0 },
 };
 
@@ -188,6 +196,26 @@ pci_bridge_attach(struct pci_func *pcif)
 	return 1;
 }
 
+// Note the bus-master registers of an IDE controller that can do DMA,
+// such as the PIIX's, in BAR 4.  The controller itself is left to the
+// file server; enabling the function turns on bus mastering.
+static int
+pci_ide_attach(struct pci_func *pcif)
+{
+	// Bit 7 of the programming interface: a bus master
+	if (!(PCI_INTERFACE(pcif->dev_class) & 0x80) || pci_ide_bmbase)
+		return 0;
+
+	pci_func_enable(pcif);
+	if (PCI_MAPREG_TYPE(pci_conf_read(pcif, PCI_MAPREG_START + 4 * 4)) !=
+	    PCI_MAPREG_TYPE_IO || pcif->reg_base[4] == 0)
+		return 0;
+
+	pci_ide_bmbase = pcif->reg_base[4];
+	cprintf("PCI: IDE bus master at io 0x%x\n", pci_ide_bmbase);
+	return 1;
+}
+
 // External PCI subsystem interface
 
 void
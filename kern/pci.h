@@ -31,6 +31,8 @@ struct pci_bus {
     uint32_t busno;
 };
 
+extern uint32_t pci_ide_bmbase;
+
 int  pci_init(void);
 void pci_func_enable(struct pci_func *f);
 
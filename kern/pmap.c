@@ -5,11 +5,13 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +20,54 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static bool pse;		// 4MB pages (CR4.PSE) are on
+
+// Free physical memory is kept by a buddy allocator.  Free blocks of
+// 2^order pages, aligned to their size, sit on page_free_list[order],
+// doubly linked through pp_link/pp_prev of their first page, which
+// also records the order in pp_order.  A block's buddy is the block it
+// was split from its parent with, so freeing a block merges it with
+// its buddy for as long as the buddy is free too.  Single pages are
+// cached per CPU in front of the lists; see page_alloc.
+static struct PageInfo *page_free_list[PAGE_MAX_ORDER + 1];
+static size_t page_free_count[PAGE_MAX_ORDER + 1];
+
+// Pages that idle CPUs have already zeroed, for page_alloc(ALLOC_ZERO),
+// linked through pp_link.  The pool is topped up to PAGE_ZERO_TARGET.
+#define PAGE_ZERO_TARGET	512
+static struct PageInfo *page_zero_list;
+static size_t page_zero_count;
+
+static struct spinlock page_zero_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_zero_lock",
+	.rank = LOCK_RANK_PAGE_ZERO
+#endif
+};
+
+// Protects page_free_list, page_free_count and the pp_ref counts of all pages
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock",
+	.rank = LOCK_RANK_PAGE
+#endif
+};
+
+// Serializes TLB shootdowns; the holder owns tlb_req
+static struct spinlock tlb_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "tlb_lock",
+	.rank = LOCK_RANK_TLB
+#endif
+};
+
+// The TLB shootdown in progress, see tlb_shootdown()
+static struct {
+	physaddr_t cr3;			// Address space to flush
+	void *va;			// Page to flush, unless all is set
+	bool all;			// Flush all of the address space
+	volatile uint32_t pending;	// CPUs yet to flush, by index in cpus[]
+} tlb_req;
 
 
 // --------------------------------------------------------------
@@ -65,6 +114,10 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_remove_large(pde_t *pgdir, void *va);
+static void tlb_shootdown(pde_t *pgdir, void *va, bool all);
+static void tlb_defer_decref(pde_t *pgdir, void *va, struct PageInfo *pp);
+static void tlb_release(pde_t *pgdir, void *va, bool all);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -209,6 +262,7 @@ mem_init(void)
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
+	mem_init_percpu();
 
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
@@ -221,7 +275,7 @@ mem_init(void)
 	//page_insert(pgdir,pages_page,UPAGES,PTE_U | PTE_P);	
 	for(physaddr_t pa=PADDR(pages),offset=0;offset<sizeof(struct PageInfo)*npages;offset+=PGSIZE,pa+=PGSIZE){
 		uintptr_t va=UPAGES+offset;	
-		*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_U | PTE_P;
+		*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_U | PTE_P | PTE_G;
 	}
 	
 
@@ -234,7 +288,7 @@ mem_init(void)
 	// LAB 3: Your code here.
 	for(physaddr_t pa=PADDR(envs),offset=0;offset<sizeof(struct Env)*NENV;pa+=PGSIZE,offset+=PGSIZE){
 		uintptr_t va=UENVS+offset;
-		*pgdir_walk(kern_pgdir,(void*)va,1)=pa|PTE_U|PTE_P;
+		*pgdir_walk(kern_pgdir,(void*)va,1)=pa|PTE_U|PTE_P|PTE_G;
 	}
 
 	//////////////////////////////////////////////////////////////////////
@@ -252,7 +306,7 @@ mem_init(void)
 		physaddr_t pa=PADDR(bootstack) + offset;
 		//struct PageInfo* page=pa2page(pa);
 		//page_insert(pgdir,page,va,PTE_P);
-		*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_P | PTE_W;
+		*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_P | PTE_W | PTE_G;
 	}
 
 	//for(uintptr_t va=KSTACKTOP-PTSIZE,offset=0;va < KSTACKTOP-KSTKSIZE;va += PGSIZE,offset += PGSIZE){
@@ -267,10 +321,14 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	for(physaddr_t pa=0;pa<0xFFFFFFFF-KERNBASE;pa += PGSIZE){
+	// With PSE these are 4MB pages, which take no page tables and
+	// cover the whole direct map with a few dozen TLB entries.
+	for(physaddr_t pa=0;pa<0xFFFFFFFF-KERNBASE;pa += (pse ? PTSIZE : PGSIZE)){
 		uintptr_t va=pa+KERNBASE;
-		//page_insert(pgdir,);
-		*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_P | PTE_W;
+		if(pse)
+			kern_pgdir[PDX(va)]=pa | PTE_PS | PTE_P | PTE_W | PTE_G;
+		else
+			*pgdir_walk(kern_pgdir,(void*)va,1)=pa | PTE_P | PTE_W | PTE_G;
 	}
 
 	// Initialize the SMP-related parts of the memory map
@@ -286,7 +344,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 
 	check_page_free_list(0);
 
@@ -301,6 +359,25 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+//
+// Turn on the paging features we use on this CPU, before it loads
+// kern_pgdir: 4MB pages (CR4.PSE), for the direct map and PTE_PS user
+// pages, and global pages (CR4.PGE), so that the kernel's PTE_G
+// mappings stay in the TLB across the CR3 loads in env_run.
+//
+void
+mem_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse = (edx & CPUID_PSE) != 0;
+	if (pse)
+		lcr4(rcr4() | CR4_PSE);
+	if (edx & CPUID_PGE)
+		lcr4(rcr4() | CR4_PGE);
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -329,7 +406,7 @@ mem_init_mp(void)
 		uintptr_t start=end-KSTKSIZE;
 
 		for(uintptr_t va=start;va<end;va+=PGSIZE){
-			*pgdir_walk(kern_pgdir,(void*)va,1)=(PADDR(percpu_kstacks[i])+(va-start)) | PTE_P | PTE_W;
+			*pgdir_walk(kern_pgdir,(void*)va,1)=(PADDR(percpu_kstacks[i])+(va-start)) | PTE_P | PTE_W | PTE_G;
 		}
 	}
 }
@@ -346,6 +423,9 @@ mem_init_mp(void)
 // allocator functions below to allocate and deallocate physical
 // memory via the page_free_list.
 //
+// Free pages are handed to page_free_order one at a time, which merges
+// them into the largest blocks their alignment allows.
+//
 void
 page_init(void)
 {
@@ -372,10 +452,14 @@ page_init(void)
 	// free pages!
 	size_t i;
 
-	page_free_list=NULL;
+	memset(page_free_list,0,sizeof(page_free_list));
+	memset(page_free_count,0,sizeof(page_free_count));
 
 	//cprintf("Boot alloc start %x, end %x\n",bootAllocStart,bootAllocEnd);
 
+	for (i = 0; i < npages; i++)
+		pages[i].pp_order = -1;
+
 	for (i = 0; i < npages; i++) {
 		//Rule 1: Reserve page 0
 		if(i==0)
@@ -410,9 +494,193 @@ page_init(void)
 		}
 
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		pages[i].pp_link = NULL;
+		page_free_order(&pages[i], 0);
+	}
+}
+
+// Free list maintenance.  The caller must hold page_lock.
+static void
+page_list_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_list[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_list[order] = pp;
+	page_free_count[order]++;
+}
+
+static void
+page_list_remove(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_list[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	page_free_count[order]--;
+
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_order = -1;
+}
+
+// Take a block of 2^order pages off the free lists, or return NULL.
+// The caller must hold page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !page_free_list[o]; o++)
+		;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = page_free_list[o];
+	page_list_remove(pp, o);
+	while (o > order) {
+		o--;
+		page_list_push(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Put a block of 2^order pages back on the free lists.
+// The caller must hold page_lock.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	struct PageInfo *buddy;
+	size_t i = pp - pages;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		if ((i ^ (1 << order)) >= npages)
+			break;
+		buddy = &pages[i ^ (1 << order)];
+		if (buddy->pp_order != order)
+			break;
+		page_list_remove(buddy, order);
+		i &= ~(1 << order);
 	}
+	page_list_push(&pages[i], order);
+}
+
+//
+// Allocates a physically contiguous block of 2^order pages, aligned to
+// its size, and returns its first page.  Takes the smallest free block
+// that is big enough, splitting off and freeing the unused halves.
+// Flags are as for page_alloc, with ALLOC_ZERO zeroing the whole block.
+// The block must be returned with page_free_order and the same order;
+// only its first page's pp_ref is meaningful.
+//
+// Returns NULL if no free block is big enough.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp == NULL)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+
+	return pp;
+}
+
+//
+// Return a block from page_alloc_order to the free lists, merging it
+// with its buddy, and the result with its buddy, and so on.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref != 0)
+		panic("PP_REF is not 0");
+	if (pp->pp_link != NULL || pp->pp_order >= 0)
+		panic("Page is already free");
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((pp - pages) % (1 << order) == 0);
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Take a page from the pre-zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+page_zero_take(void)
+{
+	struct PageInfo *pp;
+
+	if (page_zero_count == 0)
+		return NULL;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_zero_count--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+//
+// Called by an idle CPU before it halts: zero free pages into the pool
+// until it is full, or until someone gives us work, which they do by
+// setting our cpu_status back to CPU_STARTED (see sched_wake()).
+//
+void
+page_zero_idle(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *pp;
+
+	while (page_zero_count < PAGE_ZERO_TARGET &&
+	       c->cpu_status == CPU_HALTED) {
+		if ((pp = page_alloc(0)) == NULL)
+			return;
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		spin_unlock(&page_zero_lock);
+		c->cpu_zero_fills++;
+	}
+}
+
+//
+// The number of pages in the pre-zeroed pool.
+//
+size_t
+page_nzero(void)
+{
+	return page_zero_count;
+}
+
+//
+// The number of free blocks of 2^order pages on the buddy lists.  Pages
+// cached in the per-CPU magazines are not counted.
+//
+size_t
+page_nfree(int order)
+{
+	return page_free_count[order];
 }
 
 //
@@ -426,23 +694,51 @@ page_init(void)
 //
 // Returns NULL if out of free memory.
 //
+// Single pages come from this CPU's magazine, a small stack of free
+// pages that only this CPU touches (the kernel runs with interrupts
+// off, so nothing else can run here meanwhile), and so need no lock.
+// An empty magazine is refilled with PAGE_MAG_BATCH pages under one
+// acquisition of page_lock.
+//
+// ALLOC_ZERO pages come from the pool of pages that idle CPUs zeroed
+// beforehand, when it has any.  That pool is also the last resort once
+// the magazine and the buddy lists are empty.
+//
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if(page_free_list == NULL)
-		return NULL;
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *pp;
 
-	struct PageInfo* page=page_free_list;
-	page_free_list=page_free_list -> pp_link;
+	if (alloc_flags & ALLOC_ZERO) {
+		if ((pp = page_zero_take()) != NULL) {
+			c->cpu_zero_hits++;
+			return pp;
+		}
+		c->cpu_zero_misses++;
+	}
 
-	page -> pp_link = NULL;
+	if (c->cpu_npages == 0) {
+		spin_lock(&page_lock);
+		while (c->cpu_npages < PAGE_MAG_BATCH &&
+		       (pp = buddy_alloc(0)) != NULL)
+			c->cpu_pages[c->cpu_npages++] = pp;
+		spin_unlock(&page_lock);
+		c->cpu_page_refills++;
+		if (c->cpu_npages == 0)
+			return page_zero_take();
+	} else {
+		c->cpu_page_hits++;
+	}
 
-	if(alloc_flags & ALLOC_ZERO)
-		memset(page2kva(page),0,PGSIZE);
+	pp = c->cpu_pages[--c->cpu_npages];
 
-	return page;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE);
+
+	return pp;
 }
 
 //
@@ -455,20 +751,30 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
-	
-	if(pp -> pp_ref != 0){
+	struct CpuInfo *c = thiscpu;
+	int i;
+
+	if (pp->pp_ref != 0)
 		panic("PP_REF is not 0");
-		return;
-	}
-	
-	if(pp -> pp_link != NULL){
-		panic("PP_LINK is not NULL");
-		return;
+	if (pp->pp_link != NULL || pp->pp_order >= 0)
+		panic("Page is already free");
+
+	// A full magazine gives its bottom, least recently freed, pages
+	// back to the buddy lists, keeping the cache-warm ones.
+	if (c->cpu_npages == PAGE_MAG_SIZE) {
+		spin_lock(&page_lock);
+		for (i = 0; i < PAGE_MAG_BATCH; i++)
+			buddy_free(c->cpu_pages[i], 0);
+		spin_unlock(&page_lock);
+		memmove(c->cpu_pages, c->cpu_pages + PAGE_MAG_BATCH,
+			(PAGE_MAG_SIZE - PAGE_MAG_BATCH) * sizeof(c->cpu_pages[0]));
+		c->cpu_npages -= PAGE_MAG_BATCH;
+		c->cpu_page_drains++;
+	} else {
+		c->cpu_page_hits++;
 	}
 
-	pp -> pp_link=page_free_list;
-	page_free_list=pp;
-
+	c->cpu_pages[c->cpu_npages++] = pp;
 }
 
 //
@@ -478,10 +784,28 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	uint16_t ref;
+
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+
+	if (ref == 0)
 		page_free(pp);
 }
 
+//
+// Increment the reference count on a page, for a holder that
+// isn't a mapping, such as a device request using the page.
+//
+void
+page_incref(struct PageInfo* pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -504,12 +828,17 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that manipulate page
 // table and page directory entries.
 //
+// A va inside a 4MB (PTE_PS) page has no PTE, so that gives NULL too.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	// Fill this function in
 	pde_t pd_item=pgdir[PDX(va)];
 
+	if(pd_item & PTE_PS)
+		return NULL;
+
 	//Check if this page exist
 	if(pd_item & PTE_P){
 		return KADDR(PTE_ADDR(pd_item))+sizeof(pte_t)*PTX(va);
@@ -576,6 +905,7 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is inside a 4MB page, which has no page table
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -583,42 +913,151 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
-	// Fill this function in
+	int r;
+
+	if ((r = page_insert_noinval(pgdir, pp, va, perm)) < 0)
+		return r;
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+//
+// page_insert without the TLB invalidation, for callers that change
+// many mappings and then flush once with tlb_flush().  Returns 1 if
+// a page formerly mapped at 'va' was replaced, so that the TLB must
+// be flushed, 0 if nothing was there, or -E_NO_MEM or -E_INVAL as
+// for page_insert.
+//
+int
+page_insert_noinval(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	if(pgdir[PDX(va)] & PTE_PS)
+		return -E_INVAL;
+
 	pte_t* pt_item=pgdir_walk(pgdir,va,1);
 	if(pt_item == NULL)
 		return -E_NO_MEM;
 
+	//Take the new reference first, so that re-inserting the same page
+	//at the same va can't free it in page_remove below
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+
+	int replaced=0;
 	if(*pt_item & PTE_P)
-		page_remove(pgdir,va);
+		replaced=page_remove_noinval(pgdir,va);
 
-	if(pp->pp_ref==0){
-		//Check if it's on the free list
-		//Should remove from free list
+	physaddr_t pa=page2pa(pp);
+	*pt_item=(pa & ~0XFFF) | perm | PTE_P;
 
-		struct PageInfo* last=page_free_list;
-		while(last != pp && last != NULL && last -> pp_link != pp){
-			last=last -> pp_link;
+	return replaced;
+}
+
+//
+// Copy the user part of the address space 'src' into the empty 'dst',
+// for fork.  PTE_SHARE pages stay shared as they are; writable and
+// copy-on-write pages become copy-on-write in both; read-only pages are
+// shared read-only.  Page tables with nothing mapped are skipped whole,
+// and each page table's references are taken under one page_lock.  The
+// page at UXSTACKTOP - PGSIZE is not copied, as the child needs its own
+// exception stack.
+//
+// Writable mappings in src may become read-only, so the caller must
+// flush src's TLB entries afterwards.
+//
+// 4MB pages aren't shared copy-on-write: dst gets its own copy.
+//
+// Returns 0, or -E_NO_MEM if a page table or a 4MB copy can't be
+// allocated, leaving dst partly filled in.
+//
+int
+pgdir_fork(pde_t *dst, pde_t *src)
+{
+	uint32_t pdeno, pteno;
+	pte_t *spt, *dpt, pte;
+	struct PageInfo *pp;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src[pdeno] & PTE_P))
+			continue;
+		if (src[pdeno] & PTE_PS) {
+			if (!(pp = page_alloc_order(PAGE_LARGE_ORDER, 0)))
+				return -E_NO_MEM;
+			memcpy(page2kva(pp), KADDR(PTE_ADDR(src[pdeno])), PTSIZE);
+			page_insert_large(dst, pp, PGADDR(pdeno, 0, 0),
+					  src[pdeno] & PTE_SYSCALL);
+			continue;
 		}
-		
-		if(page_free_list==pp){
-			page_free_list=pp->pp_link;
-			pp->pp_link=NULL;
-		}else{
-			if(last != NULL){
-				last->pp_link=pp->pp_link;
-				pp->pp_link=NULL;
+		spt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+
+		for (pteno = 0; pteno < NPTENTRIES && !(spt[pteno] & PTE_P); pteno++)
+			;
+		if (pteno == NPTENTRIES)
+			continue;
+		if ((dpt = pgdir_walk(dst, PGADDR(pdeno, 0, 0), 1)) == NULL)
+			return -E_NO_MEM;
+
+		spin_lock(&page_lock);
+		for (; pteno < NPTENTRIES; pteno++) {
+			pte = spt[pteno];
+			if (!(pte & PTE_P) ||
+			    PGADDR(pdeno, pteno, 0) == (void *) (UXSTACKTOP - PGSIZE))
+				continue;
+
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				spt[pteno] = pte;
 			}
+			dpt[pteno] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+			pa2page(PTE_ADDR(pte))->pp_ref++;
 		}
-
+		spin_unlock(&page_lock);
 	}
+	return 0;
+}
 
-	physaddr_t pa=page2pa(pp);
-	pp->pp_ref++;
-	*pt_item=(pa & ~0XFFF) | perm | PTE_P;
-
-	tlb_invalidate(pgdir,va);
+//
+// Resolve a write fault at 'va' in 'pgdir' on a copy-on-write page.
+// If nobody else maps the page it just becomes writable; otherwise
+// it is copied into a new page, mapped writable in its place.
+//
+// Returns 0 on success, -E_INVAL if there is no copy-on-write user
+// page at va, or -E_NO_MEM if the copy can't be allocated.
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm, r;
+	bool sole;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pte = pgdir_walk(pgdir, va, 0)) ||
+	    (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW))
+		return -E_INVAL;
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	// Only a mapping in pgdir itself could add a reference, and the
+	// caller holds its env's lock, so a sole owner stays sole.
+	spin_lock(&page_lock);
+	sole = pp->pp_ref == 1;
+	spin_unlock(&page_lock);
+	if (sole) {
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
 
-	return 0;
+	if (!(np = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	if ((r = page_insert(pgdir, np, va, perm)) < 0)
+		page_free(np);
+	return r;
 }
 
 //
@@ -665,31 +1104,247 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
+// If va is inside a 4MB page, the whole 4MB page is unmapped.
+//
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	// Fill this function in
+	if (page_remove_noinval(pgdir, va))
+		tlb_invalidate(pgdir, va);
+}
+
+//
+// page_remove without the TLB invalidation.  Returns true if a page
+// was unmapped, in which case the caller must flush the TLB.
+//
+bool
+page_remove_noinval(pde_t *pgdir, void *va)
+{
+	if(pgdir[PDX(va)] & PTE_PS){
+		page_remove_large(pgdir,va);
+		return true;
+	}
+
 	pte_t* pt_item;
 	struct PageInfo* page=page_lookup(pgdir,va,&pt_item);
 	if(page==NULL)
-		return;
-
-	page_decref(page);
+		return false;
 
 	*pt_item=0;
-	tlb_invalidate(pgdir,va);
+
+	//Another CPU may still use the page through its TLB, so it can't
+	//be freed before the flush the caller owes us
+	tlb_defer_decref(pgdir,va,page);
+	return true;
+}
+
+//
+// Map the 4MB block 'pp' from page_alloc_order(PAGE_LARGE_ORDER) as
+// one PTE_PS page at the 4MB-aligned 'va', with permissions perm|PTE_P.
+// pp->pp_ref is incremented if this succeeds.
+//
+// A 4MB page has no page table, so it needs the page directory entry
+// for va to itself.  Such pages can't be shared with page_lookup/
+// page_insert; fork copies them instead.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if 4MB pages aren't supported, va isn't 4MB-aligned, or
+//     there's already a page table or page at va
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	if (!pse || (uintptr_t) va % PTSIZE || (pgdir[PDX(va)] & PTE_P))
+		return -E_INVAL;
+
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+
+	pgdir[PDX(va)] = page2pa(pp) | perm | PTE_PS | PTE_P;
+	return 0;
+}
+
+// Unmap the 4MB page that contains 'va', freeing it when the last
+// reference goes.  4MB pages are rare, so instead of deferring the
+// free until the caller flushes the TLB, flush it here too.
+static void
+page_remove_large(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(pgdir[PDX(va)]));
+	uint16_t ref;
+
+	pgdir[PDX(va)] = 0;
+	tlb_invalidate(pgdir, va);
+
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+
+	if (ref == 0)
+		page_free_order(pp, PAGE_LARGE_ORDER);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Invalidate the TLB entry for 'va' in 'pgdir', on every CPU that has
+// 'pgdir' loaded.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	tlb_shootdown(pgdir, va, false);
+}
+
+//
+// Flush all of 'pgdir' from the TLB of every CPU that has it loaded,
+// after changing many of its mappings.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	tlb_shootdown(pgdir, NULL, true);
+}
+
+//
+// Flush 'va', or all of the address space if 'all' is set, from the
+// TLBs of the CPUs that have 'pgdir' loaded.  A CPU only caches the
+// address space loaded in its CR3 (kernel mappings are global and never
+// change), since loading CR3 flushes the rest, so those are the CPUs
+// whose cpu_cr3 is pgdir.  They get an IRQ_TLB IPI, and we wait until
+// they have all flushed.  The kernel runs with interrupts off, so a CPU
+// that is in the kernel flushes when it next spins on a lock, or when
+// it returns to user mode and takes the IPI; see tlb_shootdown_poll().
+// One CPU shoots down at a time.
+//
+// Then drop the page references that were waiting for this flush.
+//
+static void
+tlb_shootdown(pde_t *pgdir, void *va, bool all)
+{
+	physaddr_t cr3 = PADDR(pgdir);
+	struct CpuInfo *c;
+	uint64_t start;
+
+	if (thiscpu->cpu_cr3 == cr3) {
+		if (all)
+			tlbflush();
+		else
+			invlpg(va);
+	}
+
+	// Taking the lock also orders the page table changes before our
+	// reads of cpu_cr3; pgdir_load() sets cpu_cr3 before loading CR3,
+	// so a CPU we don't see yet will read the new page tables.
+	spin_lock(&tlb_lock);
+	tlb_req.pending = 0;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_cr3 == cr3)
+			tlb_req.pending |= 1 << (c - cpus);
+
+	if (tlb_req.pending) {
+		tlb_req.cr3 = cr3;
+		tlb_req.va = va;
+		tlb_req.all = all;
+
+		start = read_tsc();
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (tlb_req.pending & (1 << (c - cpus))) {
+				lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+				thiscpu->cpu_tlb_ipis++;
+			}
+		while (tlb_req.pending)
+			asm volatile ("pause");
+
+		thiscpu->cpu_tlb_shootdowns++;
+		thiscpu->cpu_tlb_cycles += read_tsc() - start;
+	}
+	spin_unlock(&tlb_lock);
+
+	tlb_release(pgdir, va, all);
+}
+
+//
+// Carry out the TLB shootdown in progress, if it is waiting for this
+// CPU.  Called for IRQ_TLB, and by spin_lock() while it spins.
+//
+void
+tlb_shootdown_poll(void)
+{
+	uint32_t bit = 1 << (thiscpu - cpus);
+
+	if (!(tlb_req.pending & bit))
+		return;
+
+	if (thiscpu->cpu_cr3 == tlb_req.cr3) {
+		if (tlb_req.all)
+			tlbflush();
+		else
+			invlpg(tlb_req.va);
+	}
+	thiscpu->cpu_tlb_remote++;
+
+	asm volatile("lock; andl %1, %0" : "+m" (tlb_req.pending) : "r" (~bit));
+}
+
+//
+// Drop a reference to 'pp', just unmapped from 'va' in 'pgdir', once
+// the TLB flush the caller owes for it has been done.  Until then
+// another CPU may still reach the page through its TLB, so it must not
+// be freed and reused.
+//
+static void
+tlb_defer_decref(pde_t *pgdir, void *va, struct PageInfo *pp)
+{
+	struct CpuInfo *c = thiscpu;
+
+	while (c->cpu_ntlb_free == TLB_FREE_MAX)
+		tlb_flush(c->cpu_tlb_free[0].tf_pgdir);
+
+	c->cpu_tlb_free[c->cpu_ntlb_free].tf_pgdir = pgdir;
+	c->cpu_tlb_free[c->cpu_ntlb_free].tf_va = va;
+	c->cpu_tlb_free[c->cpu_ntlb_free].tf_page = pp;
+	c->cpu_ntlb_free++;
+}
+
+//
+// Drop the references deferred by tlb_defer_decref() that the flush
+// of 'va', or of all of 'pgdir' if 'all' is set, has made safe.
+//
+static void
+tlb_release(pde_t *pgdir, void *va, bool all)
+{
+	struct CpuInfo *c = thiscpu;
+	struct TlbFree *f;
+	int n = 0;
+
+	for (f = c->cpu_tlb_free; f < c->cpu_tlb_free + c->cpu_ntlb_free; f++) {
+		if (f->tf_pgdir == pgdir && (all || f->tf_va == va))
+			page_decref(f->tf_page);
+		else
+			c->cpu_tlb_free[n++] = *f;
+	}
+	c->cpu_ntlb_free = n;
+}
+
+//
+// Switch this CPU to the address space 'pgdir'.  Loading CR3 flushes
+// every non-global TLB entry, so skip it when 'pgdir' is already
+// loaded, as when an environment is resumed after a trap.  All CR3
+// loads must go through here, so that a page directory freed and
+// reused for a new environment is never mistaken for the loaded one.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	physaddr_t cr3 = PADDR(pgdir);
+
+	if (thiscpu->cpu_cr3 == cr3)
+		return;
+	// Publish the switch first, see tlb_shootdown()
+	thiscpu->cpu_cr3 = cr3;
+	lcr3(cr3);
+	thiscpu->cpu_cr3_loads++;
 }
 
 //
@@ -732,7 +1387,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 
 	// boot_map_region(kern_pgdir,base,end-base,pa,PTE_PCD|PTE_PWT|PTE_W);
 	for(uintptr_t va=base;va<end;va+=PGSIZE){
-		*pgdir_walk(kern_pgdir,(void*)va,1)=(pa+(va-base)) | PTE_PCD|PTE_PWT|PTE_W | PTE_P;
+		*pgdir_walk(kern_pgdir,(void*)va,1)=(pa+(va-base)) | PTE_PCD|PTE_PWT|PTE_W | PTE_P | PTE_G;
 		// boot_map_region(kern_pgdir,va,PGSIZE,pa+(va-base),PTE_PCD|PTE_PWT|PTE_W);
 	}
 
@@ -784,6 +1439,9 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	for(uintptr_t current_va=start_va;current_va<end_va;current_va+=PGSIZE){
 		pte_t* pte=pgdir_walk(env->env_pgdir,(void*)current_va,0);
+		//A 4MB page's PDE stands in for its PTEs
+		if(env->env_pgdir[PDX(current_va)] & PTE_PS)
+			pte=&env->env_pgdir[PDX(current_va)];
 		// cprintf("Pte for va %x is %x and check val is %d\n",current_va,*pte,(*pte & perm) != perm);
 		if(pte == NULL || (*pte & perm) != perm){
 			user_mem_check_addr=current_va;
@@ -827,56 +1485,79 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int order, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		if (page_free_list[order])
+			break;
+	if (order > PAGE_MAX_ORDER)
+		panic("'page_free_list' is empty!");
 
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
+		// Move blocks with lower addresses first in each free
 		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+		for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+			struct PageInfo *pp1, *pp2;
+			struct PageInfo **tp[2] = { &pp1, &pp2 };
+			for (pp = page_free_list[order]; pp; pp = pp->pp_link) {
+				int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+				*tp[pagetype] = pp;
+				tp[pagetype] = &pp->pp_link;
+			}
+			*tp[1] = 0;
+			*tp[0] = pp2;
+			page_free_list[order] = pp1;
+			for (blk = NULL, pp = pp1; pp; blk = pp, pp = pp->pp_link)
+				pp->pp_prev = blk;
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);;
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (blk = page_free_list[order]; blk; blk = blk->pp_link)
+			for (pp = blk; pp < blk + (1 << order); pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
 
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		i = 0;
+		pp = NULL;
+		for (blk = page_free_list[order]; blk; pp = blk, blk = blk->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(blk >= pages);
+			assert(blk + (1 << order) <= pages + npages);
+			assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+			assert((blk - pages) % (1 << order) == 0);
+			assert(blk->pp_order == order);
+			assert(blk->pp_prev == pp);
+			i++;
+		}
+		assert(i == page_free_count[order]);
+
+		for (blk = page_free_list[order]; blk; blk = blk->pp_link) {
+			for (pp = blk; pp < blk + (1 << order); pp++) {
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(pp) != MPENTRY_PADDR);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -885,6 +1566,47 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list() succeeded!\n");
 }
 
+// Count the free pages, including those in the magazines.
+static int
+check_nfree(void)
+{
+	int order, nfree = 0;
+	struct CpuInfo *c;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		nfree += page_free_count[order] << order;
+	for (c = cpus; c < cpus + NCPU; c++)
+		nfree += c->cpu_npages;
+	return nfree + page_zero_count;
+}
+
+// Allocate every free page, chained through pp_link, so that the
+// checks can run the allocator dry.
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0)) != NULL) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Free the pages taken by check_steal_free_pages.
+static void
+check_return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl) != NULL) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -902,8 +1624,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -919,8 +1640,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -948,7 +1668,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -956,9 +1676,17 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == check_nfree());
+
+	// a contiguous block should be aligned and coalesce on free
+	for (i = 0; i <= PAGE_MAX_ORDER; i++) {
+		if (!(pp = page_alloc_order(i, 0)))
+			continue;
+		assert((pp - pages) % (1 << i) == 0);
+		assert(check_nfree() == nfree - (1 << i));
+		page_free_order(pp, i);
+		assert(check_nfree() == nfree);
+	}
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -1039,6 +1767,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1069,8 +1799,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1190,7 +1919,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1262,5 +1991,32 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// check 4MB pages, if the CPU has them: one goes where nothing is
+	// mapped, translates and holds data like its 4KB pages, takes no
+	// 4KB pages inside it, and is removed whole
+	if (pse) {
+		va = 4 * PTSIZE;
+		assert(!(kern_pgdir[PDX(va)] & PTE_P));
+		assert((pp = page_alloc_order(PAGE_LARGE_ORDER, 0)));
+		assert((pp1 = page_alloc(0)));
+		assert(page_insert_large(kern_pgdir, pp, (void*) (va + PGSIZE), PTE_W) == -E_INVAL);
+		assert(page_insert_large(kern_pgdir, pp, (void*) va, PTE_W) == 0);
+		assert(pp->pp_ref == 1);
+		assert(kern_pgdir[PDX(va)] & PTE_PS);
+		assert(check_va2pa(kern_pgdir, va + 5 * PGSIZE) == page2pa(pp) + 5 * PGSIZE);
+		*(uint32_t *) (va + 5 * PGSIZE) = 0x04040404U;
+		assert(*(uint32_t *) (page2kva(pp) + 5 * PGSIZE) == 0x04040404U);
+		assert(page_insert_large(kern_pgdir, pp, (void*) va, PTE_W) == -E_INVAL);
+		// there's no page table to look up or insert a 4KB page in
+		assert(page_lookup(kern_pgdir, (void*) (va + 5 * PGSIZE), NULL) == NULL);
+		assert(page_insert(kern_pgdir, pp1, (void*) (va + PGSIZE), PTE_W) == -E_INVAL);
+		assert(pp1->pp_ref == 0);
+		page_remove(kern_pgdir, (void*) (va + 5 * PGSIZE));
+		assert(!(kern_pgdir[PDX(va)] & PTE_P));
+		assert(check_va2pa(kern_pgdir, va) == ~0);
+		assert(pp->pp_ref == 0);
+		page_free(pp1);
+	}
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
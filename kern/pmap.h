@@ -51,17 +51,37 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// page_alloc_order hands out physically contiguous, naturally aligned
+// blocks of 2^order pages, for order 0 to PAGE_MAX_ORDER.
+#define PAGE_MAX_ORDER	10
+
+// The order of a 4MB (PTE_PS) page.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+size_t	page_nfree(int order);
+size_t	page_nzero(void);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+int	page_insert_noinval(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+bool	page_remove_noinval(pde_t *pgdir, void *va);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	pgdir_load(pde_t *pgdir);
+void	tlb_shootdown_poll(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -89,5 +109,7 @@ page2kva(struct PageInfo *pp)
 }
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+int	pgdir_fork(pde_t *dst, pde_t *src);
+int	page_cow(pde_t *pgdir, void *va);
 
 #endif /* !JOS_KERN_PMAP_H */
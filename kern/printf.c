@@ -5,22 +5,33 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+#include <kern/spinlock.h>
+
 
 static void
 putch(int ch, int *cnt)
 {
 	//int color_mask=0b01100011;
 	//ch |= (color_mask << 8);
-	cputchar(ch);
+	cputchar_locked(ch);
 	*cnt++;
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	// Once we're panicking the lock may be held by the CPU that
+	// panicked (possibly us), so just print.
+	bool locked = (panicstr == NULL);
 
+	if (locked)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -4,56 +4,318 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/time.h>
+
+// Length of a time slice, in milliseconds
+#define SCHED_SLICE	10
 
 void sched_halt(void);
+static void sched_wake(void);
+
+// Each CPU keeps a FIFO run queue of ENV_RUNNABLE environments,
+// doubly linked through env_rq_next/env_rq_prev so an env can be
+// removed from the middle in O(1) (e.g. when it is destroyed).
+// Queues are only touched by env_set_status(), so an env is queued
+// exactly while it is ENV_RUNNABLE.  A running env is on no queue.
+//
+// sched_lock protects all run queues and env_nactive.
+
+struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sched_lock",
+	.rank = LOCK_RANK_SCHED
+#endif
+};
+
+// Envs blocked until a deadline (sys_sleep_until, sys_ipc_recv_timeout)
+// sit in a binary min-heap ordered by env_wakeup, so the earliest
+// deadline, which the timers are armed for, is always sleepers[0].
+// env_sleep_idx is each env's slot, for O(log n) removal when it is
+// woken early.  Protected by sched_lock.
+static struct Env *sleepers[NENV];
+static int nsleepers;
+
+// Append e to the tail of the current CPU's run queue.
+// The caller must hold sched_lock.
+void
+sched_enqueue(struct Env *e)
+{
+	struct CpuInfo *c = thiscpu;
+
+	assert(e->env_rq_cpu < 0);
+
+	e->env_rq_cpu = c - cpus;
+	e->env_rq_next = NULL;
+	e->env_rq_prev = c->cpu_rq_tail;
+	if (c->cpu_rq_tail)
+		c->cpu_rq_tail->env_rq_next = e;
+	else
+		c->cpu_rq_head = e;
+	c->cpu_rq_tail = e;
+	c->cpu_rq_len++;
+
+	sched_wake();
+}
+
+// Remove e from whichever run queue it is on.
+// The caller must hold sched_lock.
+void
+sched_dequeue(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	c = &cpus[e->env_rq_cpu];
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		c->cpu_rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		c->cpu_rq_tail = e->env_rq_prev;
+	c->cpu_rq_len--;
+
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+}
+
+// Heap maintenance.  The caller must hold sched_lock.
+static void
+sleep_set(int i, struct Env *e)
+{
+	sleepers[i] = e;
+	e->env_sleep_idx = i;
+}
+
+static void
+sleep_up(int i)
+{
+	struct Env *e = sleepers[i];
+
+	while (i > 0 && sleepers[(i - 1) / 2]->env_wakeup > e->env_wakeup) {
+		sleep_set(i, sleepers[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	sleep_set(i, e);
+}
+
+static void
+sleep_down(int i)
+{
+	struct Env *e = sleepers[i];
+	int child;
+
+	while ((child = 2 * i + 1) < nsleepers) {
+		if (child + 1 < nsleepers &&
+		    sleepers[child + 1]->env_wakeup < sleepers[child]->env_wakeup)
+			child++;
+		if (sleepers[child]->env_wakeup >= e->env_wakeup)
+			break;
+		sleep_set(i, sleepers[child]);
+		i = child;
+	}
+	sleep_set(i, e);
+}
+
+void
+sched_sleep(struct Env *e, unsigned deadline)
+{
+	assert(e->env_status == ENV_NOT_RUNNABLE && e->env_sleep_idx < 0);
+
+	spin_lock(&sched_lock);
+	e->env_wakeup = deadline;
+	sleep_set(nsleepers++, e);
+	sleep_up(e->env_sleep_idx);
+	spin_unlock(&sched_lock);
+}
+
+// Take e off the sleep heap.
+// The caller must hold sched_lock.
+void
+sched_unsleep(struct Env *e)
+{
+	int i = e->env_sleep_idx;
+	struct Env *last = sleepers[--nsleepers];
+
+	e->env_sleep_idx = -1;
+	if (last == e)
+		return;
+	sleep_set(i, last);
+	sleep_down(i);
+	sleep_up(last->env_sleep_idx);
+}
+
+// The earliest sleeper's deadline, or TIME_NEVER.
+static unsigned
+sched_next_wakeup(void)
+{
+	unsigned deadline;
+
+	spin_lock(&sched_lock);
+	deadline = nsleepers ? sleepers[0]->env_wakeup : TIME_NEVER;
+	spin_unlock(&sched_lock);
+	return deadline;
+}
+
+// Make every sleeper whose deadline has passed runnable.  A timed-out
+// sys_ipc_recv_timeout returns the -E_TIMEOUT it set up before blocking.
+static void
+sched_wake_sleepers(void)
+{
+	unsigned now = time_msec();
+	struct Env *e;
+
+	for (;;) {
+		spin_lock(&sched_lock);
+		e = NULL;
+		if (nsleepers && sleepers[0]->env_wakeup <= now)
+			e = sleepers[0];
+		spin_unlock(&sched_lock);
+		if (e == NULL)
+			return;
+
+		// Someone may have woken e before we got its lock
+		env_lock(e);
+		if (e->env_sleep_idx >= 0 && e->env_wakeup <= now) {
+			e->env_ipc_recving = false;
+			e->env_irq_wait = 0;
+			env_set_status(e, ENV_RUNNABLE);
+		}
+		env_unlock(e);
+	}
+}
+
+// Find work for an idle CPU: take the most recently queued env of the
+// CPU with the longest run queue.  The tail is the env least likely to
+// still have warm caches on its old CPU.
+// The caller must hold sched_lock.
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *c, *victim = NULL;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_rq_len == 0)
+			continue;
+		if (victim == NULL || c->cpu_rq_len > victim->cpu_rq_len)
+			victim = c;
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	thiscpu->cpu_rq_steals++;
+	return victim->cpu_rq_tail;
+}
+
+// Idle CPUs halt with their timer stopped, so when work is queued
+// wake one of them up to steal it.  Called with sched_lock held; see
+// sched_yield() for why that is enough not to miss a CPU going idle.
+static void
+sched_wake(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_status != CPU_HALTED)
+			continue;
+		if (xchg(&c->cpu_status, CPU_STARTED) == CPU_HALTED) {
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+			return;
+		}
+	}
+}
+
+// Start a new time slice on this CPU and run e.  The timer fires at
+// the end of the slice, or earlier if a sleeper is due first.
+static void __attribute__((noreturn))
+sched_run(struct Env *e)
+{
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+	time_arm(MIN(time_msec() + SCHED_SLICE, sched_next_wakeup()));
+	env_run(e);
+}
+
+// Claim e for this CPU: under e's lock, make sure no other CPU got
+// to it first and mark it ENV_RUNNING here.
+static bool
+sched_claim(struct Env *e)
+{
+	bool claimed = false;
+
+	env_lock(e);
+	if (e->env_status == ENV_RUNNABLE) {
+		env_set_status(e, ENV_RUNNING);
+		claimed = true;
+	}
+	env_unlock(e);
+	return claimed;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle=NULL;
+	struct Env *idle;
+	bool keep = false;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Reap curenv if another CPU destroyed it while it ran here,
+	// and find out whether we may resume it.
+	if (curenv != NULL) {
+		idle = curenv;
+		env_lock(idle);
+		if (idle->env_status == ENV_DYING) {
+			env_free(idle);
+			curenv = NULL;
+		} else {
+			keep = idle->env_status == ENV_RUNNING &&
+				idle->env_cpunum == cpunum();
+		}
+		env_unlock(idle);
+	}
+
+	sched_wake_sleepers();
+
+	// Round-robin over this CPU's run queue: take its head, and
+	// env_run() puts the preempted curenv back at the tail.
+	// If our queue is empty, steal from the busiest other CPU.
+	// Another CPU may claim our pick before we lock it, so retry
+	// until the queues are empty.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
+	// choose that environment.
 	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here:
-	
-	int cur_idx=curenv-envs;
-	if(curenv == NULL)
-		cur_idx=0;
-
-	int i=cur_idx+1;
-	i %= NENV;
+	// Envs running on other CPUs are never on a run queue, so they
+	// can't be chosen.  If there are no runnable environments,
+	// simply drop through to the code below to halt the cpu.
+	//
+	// Before halting we mark this CPU CPU_HALTED and look at the
+	// queues once more.  sched_wake() checks for halted CPUs under
+	// sched_lock after queueing, so either we see the new env here
+	// or its enqueuer sees us halted and sends us an IPI.
+	for (;;) {
+		spin_lock(&sched_lock);
+		idle=thiscpu->cpu_rq_head;
+		if(idle == NULL)
+			idle=sched_steal();
+		spin_unlock(&sched_lock);
 
-	do{
-		if(envs[i].env_status == ENV_RUNNABLE){
-			idle=&envs[i];
-			break;
+		if(idle != NULL){
+			if(sched_claim(idle))
+				sched_run(idle);
+			continue;
 		}
 
-		i++;
-		i %= NENV;
-	}while(i != (cur_idx+1)%NENV);
-
-	if(idle == NULL && curenv != NULL && curenv->env_status == ENV_RUNNING){
-		idle=curenv;
+		if(keep)
+			sched_run(curenv);
+		if(thiscpu->cpu_status == CPU_HALTED)
+			break;
+		xchg(&thiscpu->cpu_status, CPU_HALTED);
 	}
-
-	if(idle != NULL)
-		env_run(idle);
 	
 	cprintf("CPU %d halt\n",cpunum());
 
@@ -67,17 +329,9 @@ sched_yield(void)
 void
 sched_halt(void)
 {
-	int i;
-
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	if (env_nactive == 0) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -85,15 +339,15 @@ sched_halt(void)
 
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
-	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	// Make ourselves useful until there is work again
+	page_zero_idle();
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Tickless idle: no timer interrupts until the next sleeper is
+	// due.  sched_yield() already marked us CPU_HALTED, so whoever
+	// queues an env before then will wake us with an IPI.
+	time_arm(sched_next_wakeup());
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
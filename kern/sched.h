@@ -6,7 +6,23 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+extern struct spinlock sched_lock;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+// Per-CPU run queue maintenance, driven by env_set_status().
+// The caller must hold sched_lock.
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_unsleep(struct Env *e);
+
+// Block e, which must be locked and ENV_NOT_RUNNABLE, until time_msec()
+// reaches deadline.  (env_free() also uses this, under sendq_lock instead
+// of e's lock, to wake envs queued to send to a dead env, or waiting
+// on a page from it.)
+void sched_sleep(struct Env *e, unsigned deadline);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -7,16 +7,15 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/pmap.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
 #ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// Locks currently held by each CPU, for lock order checking.
+#define NHELD 8
+static struct spinlock *held_locks[NCPU][NHELD];
+static int nheld[NCPU];
 
-#ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
 get_caller_pcs(uint32_t pcs[])
@@ -41,14 +40,50 @@ holding(struct spinlock *lock)
 {
 	return lock->locked && lock->cpu == thiscpu;
 }
+
+// Panic if acquiring lk now would break the lock ranking
+// in kern/spinlock.h, then record lk as held by this CPU.
+static void
+check_lock_order(struct spinlock *lk)
+{
+	int i, id = cpunum();
+	struct spinlock *h;
+
+	for (i = 0; i < nheld[id]; i++) {
+		h = held_locks[id][i];
+		if (lk->rank == LOCK_RANK_NONE || h->rank == LOCK_RANK_NONE)
+			continue;
+		if (h->rank > lk->rank || (h->rank == lk->rank && h > lk))
+			panic("CPU %d acquiring %s (rank %d) while holding %s (rank %d)",
+			      id, lk->name, lk->rank, h->name, h->rank);
+	}
+
+	if (nheld[id] == NHELD)
+		panic("CPU %d holds too many locks acquiring %s", id, lk->name);
+	held_locks[id][nheld[id]++] = lk;
+}
+
+// Forget that this CPU holds lk.
+static void
+forget_lock(struct spinlock *lk)
+{
+	int i, id = cpunum();
+
+	for (i = 0; i < nheld[id]; i++)
+		if (held_locks[id][i] == lk) {
+			held_locks[id][i] = held_locks[id][--nheld[id]];
+			return;
+		}
+}
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int rank)
 {
 	lk->locked = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
+	lk->rank = rank;
 	lk->cpu = 0;
 #endif
 }
@@ -63,13 +98,18 @@ spin_lock(struct spinlock *lk)
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	check_lock_order(lk);
 #endif
 	
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// The holder may be waiting for us to flush our TLB, see
+	// tlb_shootdown(), and interrupts are off while we spin.
+	while (xchg(&lk->locked, 1) != 0) {
+		tlb_shootdown_poll();
 		asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -105,6 +145,7 @@ spin_unlock(struct spinlock *lk)
 
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
+	forget_lock(lk);
 #endif
 
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
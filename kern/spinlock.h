@@ -6,6 +6,24 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Lock ranks.  A CPU may only acquire a lock whose rank is higher than
+// that of every lock it already holds; locks of equal rank (the per-Env
+// locks) must be acquired in increasing address order.  With
+// DEBUG_SPINLOCK defined, spin_lock() panics on any violation.
+enum {
+	LOCK_RANK_NONE = 0,		// Not checked
+	LOCK_RANK_ENV,			// Per-Env locks, see env_lock()
+	LOCK_RANK_SENDQ,		// IPC send queues
+	LOCK_RANK_ENV_TABLE,		// env_free_list
+	LOCK_RANK_SCHED,		// Run queues and env_status counts
+	LOCK_RANK_TLB,			// TLB shootdown in progress
+	LOCK_RANK_PAGE,			// page_free_list and pp_ref
+	LOCK_RANK_PAGE_ZERO,		// Pool of pre-zeroed pages
+	LOCK_RANK_E1000,		// e1000 descriptor rings
+	LOCK_RANK_VIRTIO,		// virtio-blk virtqueue
+	LOCK_RANK_CONSOLE,		// Console input and output
+};
+
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
@@ -13,36 +31,17 @@ struct spinlock {
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
+	int rank;              // Lock ordering rank, see above.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, char *name, int rank);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#define spin_initlock(lock, rank)   __spin_initlock(lock, #lock, rank)
 
 #endif
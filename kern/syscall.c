@@ -12,8 +12,12 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/spinlock.h>
 
 #include <kern/e1000.h>
+#include <kern/pci.h>
+#include <kern/virtio.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -91,12 +95,64 @@ sys_exofork(void)
 		return ret;
 	}
 
+	//env_alloc leaves the child ENV_NOT_RUNNABLE
+	env_lock(env);
 	env->env_tf=curenv->env_tf;
 	env->env_tf.tf_regs.reg_eax=0;
+	ret=env->env_id;
+	env_unlock(env);
 
-	env->env_status=ENV_NOT_RUNNABLE;
+	return ret;
+}
+
+// Fork the caller in one system call.  The child gets a copy of the
+// caller's registers, page fault upcall and address space, copied as
+// described at pgdir_fork, plus a fresh exception stack if the caller
+// has one, and starts out runnable.
+//
+// Returns the child's envid to the caller and 0 to the child, or < 0
+// on error, with no child created.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env* child;
+	struct PageInfo* pp;
+	int r;
+
+	if((r=env_alloc(&child,curenv->env_id)) < 0){
+		return r;
+	}
+
+	//Nobody else knows about the child yet, but env_free wants it locked
+	env_lock2(curenv,child);
+	child->env_tf=curenv->env_tf;
+	child->env_tf.tf_regs.reg_eax=0;
+	child->env_pgfault_upcall=curenv->env_pgfault_upcall;
+	memmove(child->env_regions,curenv->env_regions,sizeof(child->env_regions));
+
+	r=pgdir_fork(child->env_pgdir,curenv->env_pgdir);
+	//Our writable pages may have just become copy-on-write
+	tlb_flush(curenv->env_pgdir);
+
+	if(r == 0 && page_lookup(curenv->env_pgdir,(void*)(UXSTACKTOP-PGSIZE),NULL)){
+		if((pp=page_alloc(ALLOC_ZERO)) == NULL){
+			r=-E_NO_MEM;
+		}else if((r=page_insert(child->env_pgdir,pp,(void*)(UXSTACKTOP-PGSIZE),PTE_P|PTE_U|PTE_W)) < 0){
+			page_free(pp);
+		}
+	}
 
-	return env->env_id;
+	if(r < 0){
+		env_free(child);
+	}else{
+		env_set_status(child,ENV_RUNNABLE);
+		r=child->env_id;
+	}
+	env_unlock2(curenv,child);
+
+	return r;
 }
 
 // Set envid's env_status to status, which must be ENV_RUNNABLE
@@ -117,13 +173,41 @@ sys_env_set_status(envid_t envid, int status)
 
 	// LAB 4: Your code here.
 
+	if(status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE){
+		return -E_INVAL;
+	}
+
 	struct Env* env;
 	int ret=envid2env(envid,&env,true);
 	if(ret < 0){
 		return ret;
 	}
 
-	env -> env_status=status;
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		env_unlock(env);
+		return -E_BAD_ENV;
+	}
+
+	//A running env is not on any run queue, and a dying one must
+	//stay dying until it is freed, leave them alone
+	if(env->env_status != ENV_DYING &&
+	!(env->env_status == ENV_RUNNING && status == ENV_RUNNABLE)){
+		//A blocked env made runnable stops waiting, so that what it
+		//waited on can't make it runnable again while it runs
+		if(env->env_status == ENV_NOT_RUNNABLE && status == ENV_RUNNABLE){
+			spin_lock(&sendq_lock);
+			env_sendq_remove(env);
+			env_pagein_remove(env);
+			spin_unlock(&sendq_lock);
+			env->env_ipc_recving=false;
+			env->env_pagein_region=-1;
+			env->env_irq_wait=0;
+		}
+		env_set_status(env,status);
+	}
+	env_unlock(env);
 
 	return 0;
 }
@@ -159,7 +243,14 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 
 	tf->tf_eflags &= ~FL_IOPL_3;
 
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		env_unlock(env);
+		return -E_BAD_ENV;
+	}
 	env->env_tf=*tf;
+	env_unlock(env);
 
 	return 0;
 }
@@ -182,11 +273,80 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 		return ret;
 	}
 
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		env_unlock(env);
+		return -E_BAD_ENV;
+	}
 	env->env_pgfault_upcall=func;
+	env_unlock(env);
 
 	return 0;
 }
 
+// Add the demand-paged region '*rg' to envid's address space; see
+// struct EnvRegion.  Nothing is mapped until envid touches the region.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_FAULT if rg isn't readable user memory.
+//	-E_INVAL if the region is empty, not page-aligned, reaches
+//		UTOP, or overlaps another region, if er_filesz > er_memsz,
+//		or if er_perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if envid already has NENVREGION regions.
+static int
+sys_env_add_region(envid_t envid, const struct EnvRegion *rg)
+{
+	struct EnvRegion r,*o;
+	struct Env* env;
+	int i,ret;
+
+	if(user_mem_check(curenv,rg,sizeof(*rg),PTE_U) < 0){
+		return -E_FAULT;
+	}
+	r=*rg;
+
+	if(r.er_memsz == 0 || r.er_va % PGSIZE != 0 || r.er_va >= UTOP ||
+	   r.er_memsz > UTOP - r.er_va || r.er_filesz > r.er_memsz){
+		return -E_INVAL;
+	}
+	if((r.er_perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) || (r.er_perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0){
+		return -E_INVAL;
+	}
+
+	if((ret=envid2env(envid,&env,true))<0){
+		return ret;
+	}
+
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		env_unlock(env);
+		return -E_BAD_ENV;
+	}
+
+	ret=-E_NO_MEM;
+	for(i=0;i<NENVREGION;i++){
+		o=&env->env_regions[i];
+		if(o->er_memsz == 0){
+			ret=i;
+		}else if(r.er_va < o->er_va + ROUNDUP(o->er_memsz,PGSIZE) &&
+			 o->er_va < r.er_va + ROUNDUP(r.er_memsz,PGSIZE)){
+			ret=-E_INVAL;
+			break;
+		}
+	}
+	if(ret >= 0){
+		env->env_regions[ret]=r;
+		ret=0;
+	}
+	env_unlock(env);
+
+	return ret;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -195,12 +355,16 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         With PTE_PS as well, the page is a 4MB one, for large
+//         buffers; see page_insert_large.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL for PTE_PS, if va is not 4MB-aligned, something is
+//		mapped in the 4MB at va, or the CPU lacks 4MB pages.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -219,9 +383,14 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_INVAL;
 	}
 
+	bool large=perm & PTE_PS;
+	perm&=~PTE_PS;
 	if((perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) || (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0){
 		return -E_INVAL;
 	}
+	if(large && v % PTSIZE != 0){
+		return -E_INVAL;
+	}
 
 	struct Env* env;
 	int ret=envid2env(envid,&env,true);
@@ -229,20 +398,56 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return ret;
 	}
 
-	struct PageInfo* pp=page_alloc(ALLOC_ZERO);
+	struct PageInfo* pp=large ? page_alloc_order(PAGE_LARGE_ORDER,ALLOC_ZERO) : page_alloc(ALLOC_ZERO);
 	if(pp == NULL){
 		return -E_NO_MEM;
 	}
 
-	ret=page_insert(env->env_pgdir,pp,va,perm);
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		ret=-E_BAD_ENV;
+	}else if(large){
+		ret=page_insert_large(env->env_pgdir,pp,va,perm);
+	}else{
+		ret=page_insert(env->env_pgdir,pp,va,perm);
+	}
+	env_unlock(env);
 	if(ret < 0){
-		page_free(pp);
+		if(large){
+			page_free_order(pp,PAGE_LARGE_ORDER);
+		}else{
+			page_free(pp);
+		}
 		return ret;
 	}
 
 	return 0;
 }
 
+// The part of sys_page_map that runs with both envs locked.
+static int
+sys_page_map_locked(struct Env *src_env, envid_t srcenvid, void *srcva,
+		    struct Env *dst_env, envid_t dstenvid, void *dstva, int perm)
+{
+	if(!env_is_live(src_env,srcenvid) || !env_is_live(dst_env,dstenvid)){
+		return -E_BAD_ENV;
+	}
+
+	pte_t *src_pte;
+	struct PageInfo* pp;
+	if((pp=page_lookup(src_env->env_pgdir,srcva,&src_pte)) == NULL){
+		return -E_INVAL;
+	}
+
+	//Check if src page has no PTE_W while perm has
+	if(!(*src_pte & PTE_W) && (perm & PTE_W)){
+		return -E_INVAL;
+	}
+
+	return page_insert(dst_env->env_pgdir,pp,dstva,perm);
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -296,23 +501,13 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return ret;
 	}
 
-	pte_t *src_pte;
-	struct PageInfo* pp;
-	if((pp=page_lookup(src_env->env_pgdir,srcva,&src_pte)) == NULL){
-		return -E_INVAL;
-	}
+	srcenvid=src_env->env_id;
+	dstenvid=dst_env->env_id;
+	env_lock2(src_env,dst_env);
+	ret=sys_page_map_locked(src_env,srcenvid,srcva,dst_env,dstenvid,dstva,perm);
+	env_unlock2(src_env,dst_env);
 
-	//Check if src page has no PTE_W while perm has
-	if(!(*src_pte & PTE_W) && (perm & PTE_W)){
-		return -E_INVAL;
-	}
-
-	ret=page_insert(dst_env->env_pgdir,pp,dstva,perm);
-	if(ret < 0){
-		return ret;
-	}
-
-	return 0;
+	return ret;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -339,11 +534,424 @@ sys_page_unmap(envid_t envid, void *va)
 		return ret;
 	}
 
+	envid=env->env_id;
+	env_lock(env);
+	if(!env_is_live(env,envid)){
+		env_unlock(env);
+		return -E_BAD_ENV;
+	}
 	page_remove(env->env_pgdir,va);
+	env_unlock(env);
+
+	return 0;
+}
+
+// Check the parts of a page operation that don't depend on its envs:
+// the opcode, that its ranges are page-aligned and below UTOP, and
+// perm as in sys_page_alloc.
+static int
+page_op_check(const struct PageOp *op)
+{
+	if(op->op > PAGEOP_UNMAP){
+		return -E_INVAL;
+	}
+
+	if(op->len % PGSIZE != 0 || op->dstva % PGSIZE != 0 ||
+	   op->dstva > UTOP || op->len > UTOP - op->dstva){
+		return -E_INVAL;
+	}
+
+	if(op->op == PAGEOP_MAP && (op->srcva % PGSIZE != 0 ||
+	   op->srcva > UTOP || op->len > UTOP - op->srcva)){
+		return -E_INVAL;
+	}
+
+	if(op->op != PAGEOP_UNMAP &&
+	   ((op->perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) || (op->perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)){
+		return -E_INVAL;
+	}
+
+	return 0;
+}
+
+// Carry out 'op', which has passed page_op_check, with dst (and src,
+// for PAGEOP_MAP) locked and live.  The TLB is left alone: *flush is
+// set if a mapping in dst was replaced or removed, and the caller must
+// then tlb_flush() dst's page directory.
+//
+// Stops at the first error, leaving the pages before it done.
+static int
+page_op_locked(struct Env *src, struct Env *dst, const struct PageOp *op, bool *flush)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t off;
+	int r;
+
+	for(off=0;off<op->len;off+=PGSIZE){
+		void *va=(void*)(op->dstva+off);
+
+		switch(op->op){
+		case PAGEOP_ALLOC:
+			if((pp=page_alloc(ALLOC_ZERO)) == NULL){
+				return -E_NO_MEM;
+			}
+			if((r=page_insert_noinval(dst->env_pgdir,pp,va,op->perm)) < 0){
+				page_free(pp);
+				return r;
+			}
+			break;
+		case PAGEOP_MAP:
+			if((pp=page_lookup(src->env_pgdir,(void*)(op->srcva+off),&pte)) == NULL){
+				return -E_INVAL;
+			}
+			if(!(*pte & PTE_W) && (op->perm & PTE_W)){
+				return -E_INVAL;
+			}
+			if((r=page_insert_noinval(dst->env_pgdir,pp,va,op->perm)) < 0){
+				return r;
+			}
+			break;
+		default:
+			r=page_remove_noinval(dst->env_pgdir,va);
+			break;
+		}
+		if(r > 0){
+			*flush=true;
+		}
+	}
+
+	return 0;
+}
+
+// The envs the operations of one call have looked up so far.  A batch
+// rarely names more than a couple, so a few are remembered, and any
+// more are just looked up each time.
+#define PAGEOP_NSEEN	8
 
+struct PageOpEnv {
+	envid_t id;
+	struct Env *env;
+};
+
+// envid2env for the operations of one call, which looks each envid up
+// only once: the first '*n' entries of seen[] hold the envs found so
+// far.  *envid_store is set to the env's full id, for env_is_live.
+static int
+page_op_env(envid_t *envid_store, struct Env **env_store, struct PageOpEnv *seen, int *n)
+{
+	envid_t envid=*envid_store ? *envid_store : curenv->env_id;
+	int i,r;
+
+	*envid_store=envid;
+	for(i=0;i<*n;i++){
+		if(seen[i].id == envid){
+			*env_store=seen[i].env;
+			return 0;
+		}
+	}
+
+	if((r=envid2env(envid,env_store,true)) < 0){
+		return r;
+	}
+	if(*n < PAGEOP_NSEEN){
+		seen[*n].id=envid;
+		seen[(*n)++].env=*env_store;
+	}
 	return 0;
 }
 
+// Run the page operations ops[0..n), which are in kernel memory,
+// looking up each env once and flushing the TLBs once at the end, for
+// each address space in which anything was replaced or removed (or
+// sooner, if there are too many of them to remember).  Flushing after
+// the envs are unlocked is safe: the pages unmapped aren't freed until
+// then, see tlb_defer_decref().
+//
+// Returns 0, or the error of the first operation that fails; the
+// operations (and pages) before it stay done.
+static int
+page_ops_run(const struct PageOp *ops, int n)
+{
+	struct PageOpEnv seen[PAGEOP_NSEEN];
+	// Address spaces to flush
+	pde_t *flush[PAGEOP_NSEEN];
+	struct Env *src,*dst;
+	struct PageOp op;
+	int i,j,nseen=0,nflush=0,r=0;
+	bool changed;
+
+	for(i=0;i<n && r == 0;i++){
+		op=ops[i];
+		if((r=page_op_check(&op)) < 0 ||
+		   (r=page_op_env(&op.dstenv,&dst,seen,&nseen)) < 0){
+			break;
+		}
+		src=dst;
+		op.srcenv=op.op == PAGEOP_MAP ? op.srcenv : op.dstenv;
+		if(op.op == PAGEOP_MAP && (r=page_op_env(&op.srcenv,&src,seen,&nseen)) < 0){
+			break;
+		}
+
+		changed=false;
+		env_lock2(src,dst);
+		if(!env_is_live(src,op.srcenv) || !env_is_live(dst,op.dstenv)){
+			r=-E_BAD_ENV;
+		}else{
+			r=page_op_locked(src,dst,&op,&changed);
+		}
+		if(changed){
+			for(j=0;j<nflush && flush[j] != dst->env_pgdir;j++)
+				;
+			if(j == nflush){
+				flush[nflush++]=dst->env_pgdir;
+			}
+		}
+		env_unlock2(src,dst);
+
+		if(nflush == PAGEOP_NSEEN){
+			for(j=0;j<nflush;j++){
+				tlb_flush(flush[j]);
+			}
+			nflush=0;
+		}
+	}
+
+	for(j=0;j<nflush;j++){
+		tlb_flush(flush[j]);
+	}
+	return r;
+}
+
+// Allocate zeroed pages for [va, va+len) in envid's address space,
+// as sys_page_alloc does for one page, except that va and len must
+// both be page-aligned.
+static int
+sys_page_alloc_range(envid_t envid, uintptr_t va, size_t len, int perm)
+{
+	struct PageOp op={.op=PAGEOP_ALLOC,.dstenv=envid,.dstva=va,.len=len,.perm=perm};
+
+	return page_ops_run(&op,1);
+}
+
+// Map the pages of [srcva, srcva+len) in srcenvid's address space at
+// dstva in dstenvid's, as sys_page_map does for one page.  There are
+// only five syscall arguments, so perm travels in the low 12 bits of
+// the page-aligned dstva.
+static int
+sys_page_map_range(envid_t srcenvid, uintptr_t srcva, envid_t dstenvid, uintptr_t dstva_perm, size_t len)
+{
+	struct PageOp op={.op=PAGEOP_MAP,.srcenv=srcenvid,.srcva=srcva,.dstenv=dstenvid,
+			  .dstva=ROUNDDOWN(dstva_perm,PGSIZE),.len=len,.perm=PGOFF(dstva_perm)};
+
+	return page_ops_run(&op,1);
+}
+
+// Unmap [va, va+len) in envid's address space, as sys_page_unmap does
+// for one page.
+static int
+sys_page_unmap_range(envid_t envid, uintptr_t va, size_t len)
+{
+	struct PageOp op={.op=PAGEOP_UNMAP,.dstenv=envid,.dstva=va,.len=len};
+
+	return page_ops_run(&op,1);
+}
+
+// Run the 'n' page operations in the user array 'ops', in order.
+// The array is checked once and copied in first, since the operations
+// may unmap it; see page_ops_run for the rest.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n is negative or more than PAGEOP_MAX.
+//	-E_FAULT if the array isn't readable user memory.
+//	-E_NO_MEM if there's no page to copy it into.
+//	Any error of the range syscalls above, for the first operation
+//		that fails.
+static int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+	struct PageInfo* pp;
+	int r;
+
+	if(n < 0 || n > PAGEOP_MAX){
+		return -E_INVAL;
+	}
+	if(user_mem_check(curenv,ops,n*sizeof(struct PageOp),PTE_U) < 0){
+		return -E_FAULT;
+	}
+
+	//PAGEOP_MAX operations fit in a page
+	if((pp=page_alloc(0)) == NULL){
+		return -E_NO_MEM;
+	}
+	memcpy(page2kva(pp),ops,n*sizeof(struct PageOp));
+	r=page_ops_run(page2kva(pp),n);
+	page_free(pp);
+	return r;
+}
+
+// Deliver a message from src to dst, which is receiving, as described
+// at sys_ipc_try_send, except that dst's status is left alone.  The
+// caller must hold both envs' locks.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	int r;
+
+	//Transfer page
+	if((uintptr_t)srcva < UTOP && (uintptr_t)dst->env_ipc_dstva < UTOP){
+
+		//Check page align
+		if((uintptr_t)srcva % PGSIZE != 0){
+			//Not page-aligned
+			return -E_INVAL;
+		}
+
+		//Check perm
+		if((perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) || (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0){
+			return -E_INVAL;
+		}
+
+		//Check srcva page
+		pte_t* pte;
+		struct PageInfo* pp;
+		if((pp=page_lookup(src->env_pgdir,srcva,&pte)) == NULL || !(*pte & PTE_P)){
+			//Srcva page not exists
+			return -E_INVAL;
+		}
+
+		//Check if read-only in srcva mapped to a writtable page in dstva
+		if((*pte & PTE_W) == 0 && (perm & PTE_W)){
+			return -E_INVAL;
+		}
+
+		//Map the page first, so a failure leaves the target untouched
+		if((r=page_insert(dst->env_pgdir,pp,dst->env_ipc_dstva,perm))<0){
+			return r;
+		}
+
+		dst->env_ipc_perm=perm;
+	}else{
+		//No page transfer happend, just set perm 0
+		dst->env_ipc_perm=0;
+	}
+
+	//Send value
+	dst->env_ipc_recving=false;
+	dst->env_ipc_waitfor=0;
+	dst->env_ipc_from=src->env_id;
+	dst->env_ipc_value=value;
+	dst->env_tf.tf_regs.reg_eax=0;
+
+	return 0;
+}
+
+// The part of sys_ipc_try_send that runs with both the sender and
+// the target locked.  With 'handoff' the woken target is made
+// ENV_RUNNING on this CPU, for the caller to env_run() it directly,
+// instead of being queued.
+static int
+sys_ipc_try_send_locked(struct Env *target_env, envid_t envid, uint32_t value, void *srcva, unsigned perm, bool handoff)
+{
+	int r;
+
+	if(!env_is_live(target_env,envid)){
+		return -E_BAD_ENV;
+	}
+
+	//Check if target env want to receive, and from us
+	if(!target_env->env_ipc_recving ||
+	(target_env->env_ipc_waitfor && target_env->env_ipc_waitfor != curenv->env_id)){
+		return -E_IPC_NOT_RECV;
+	}
+
+	if((r=ipc_deliver(curenv,target_env,value,srcva,perm)) < 0){
+		return r;
+	}
+
+	//Page mapped, now mark it runnable
+	env_set_status(target_env,handoff ? ENV_RUNNING : ENV_RUNNABLE);
+
+	return 0;
+}
+
+// Block curenv on target_env's send queue with a message for it, to be
+// taken when target_env next receives.  If 'call', curenv then waits
+// for a reply as sys_ipc_call does; its env_ipc_dstva and
+// env_ipc_waitfor must already be set up.  The caller must hold both
+// envs' locks, and should sched_yield() after unlocking.
+static void
+ipc_queue_send(struct Env *target_env, uint32_t value, void *srcva, unsigned perm, bool call)
+{
+	curenv->env_ipc_send_value=value;
+	curenv->env_ipc_send_srcva=srcva;
+	curenv->env_ipc_send_perm=perm;
+	curenv->env_ipc_send_call=call;
+	curenv->env_ipc_send_pagein=false;
+	//The receiver overwrites this, unless it dies first
+	curenv->env_tf.tf_regs.reg_eax=-E_BAD_ENV;
+
+	spin_lock(&sendq_lock);
+	env_sendq_push(target_env,curenv);
+	spin_unlock(&sendq_lock);
+	env_set_status(curenv,ENV_NOT_RUNNABLE);
+}
+
+// Take the oldest message queued for curenv by ipc_queue_send, as if
+// its sender had just sent it, and wake the sender.  curenv's
+// env_ipc_dstva must already be set up.  A sender whose message can't
+// be delivered gets the error instead, and we move on to the next.
+// The caller must hold no env locks.
+//
+// Returns true if a message was received, false if the queue is empty.
+static bool
+ipc_recv_queued(void)
+{
+	struct Env *s;
+	envid_t id;
+	int r;
+
+	while(true){
+		spin_lock(&sendq_lock);
+		s=curenv->env_ipc_sendq_head;
+		id=s ? s->env_id : 0;
+		spin_unlock(&sendq_lock);
+		if(s == NULL){
+			return false;
+		}
+
+		//s may leave the queue, or die, before we have it locked
+		env_lock2(curenv,s);
+		spin_lock(&sendq_lock);
+		if(!env_is_live(s,id) || s->env_ipc_sendto != curenv->env_id){
+			spin_unlock(&sendq_lock);
+			env_unlock2(curenv,s);
+			continue;
+		}
+		env_sendq_remove(s);
+		spin_unlock(&sendq_lock);
+
+		r=ipc_deliver(s,curenv,s->env_ipc_send_value,s->env_ipc_send_srcva,s->env_ipc_send_perm);
+		if(r == 0 && s->env_ipc_send_call){
+			s->env_ipc_recving=true;
+		}else if(r == 0 && s->env_ipc_send_pagein){
+			//A page-in request stays blocked until the pager's
+			//sys_pagein, or its death
+			spin_lock(&sendq_lock);
+			env_pagein_push(curenv,s);
+			spin_unlock(&sendq_lock);
+		}else{
+			s->env_tf.tf_regs.reg_eax=r;
+			env_set_status(s,ENV_RUNNABLE);
+		}
+		env_unlock2(curenv,s);
+
+		if(r == 0){
+			return true;
+		}
+	}
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -398,69 +1006,190 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		return -E_BAD_ENV;
 	}
 
-	//Check if target env want to receive
-	if(!target_env->env_ipc_recving){
-		return -E_IPC_NOT_RECV;
+	envid=target_env->env_id;
+	env_lock2(curenv,target_env);
+	r=sys_ipc_try_send_locked(target_env,envid,value,srcva,perm,false);
+	env_unlock2(curenv,target_env);
+
+	return r;
+}
+
+// Send as sys_ipc_try_send does, but if envid is not receiving, block
+// until it takes the message.  Senders blocked on the same env are
+// served in the order they arrived.
+//
+// Returns 0 once the message is taken, or < 0 on error; see
+// sys_ipc_try_send, except that -E_IPC_NOT_RECV is never returned.
+// Also -E_INVAL if envid is the caller, and -E_BAD_ENV if envid dies
+// before taking the message.  Errors about the page may only be found
+// once the message is taken.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env* target_env;
+	int r;
+
+	if((r=envid2env(envid,&target_env,false)) < 0){
+		return r;
 	}
 
-	//Check requirements for page transfer
-	if((uintptr_t)srcva < UTOP && (uintptr_t)target_env->env_ipc_dstva < UTOP){
+	if(target_env == curenv){
+		return -E_INVAL;
+	}
 
-		//Check page align
-		if((uintptr_t)srcva % PGSIZE != 0){
-			//Not page-aligned
-			return -E_INVAL;
-		}
+	envid=target_env->env_id;
+	env_lock2(curenv,target_env);
+	r=sys_ipc_try_send_locked(target_env,envid,value,srcva,perm,false);
+	//A dying caller doesn't wait; sched_yield reaps it
+	if(r == -E_IPC_NOT_RECV && curenv->env_status != ENV_DYING){
+		ipc_queue_send(target_env,value,srcva,perm,false);
+		env_unlock2(curenv,target_env);
+		sched_yield();
+	}
+	env_unlock2(curenv,target_env);
 
-		//Check perm
-		if((perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) || (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0){
-			return -E_INVAL;
-		}
+	return r;
+}
 
-		//Check srcva page
-		pte_t* pte=pgdir_walk(curenv->env_pgdir,srcva,0);
-		if(pte == NULL){
-			//Srcva page not exists
-			return -E_INVAL;
-		}
+static int sys_ipc_recv_timeout(void *dstva, unsigned deadline);
 
-		//Check if read-only in srcva mapped to a writtable page in dstva
-		if((*pte & PTE_W) == 0 && (perm & PTE_W)){
-			return -E_INVAL;
+// Send to envid as sys_ipc_try_send does, then wait like sys_ipc_recv
+// for a message into 'dstva', only accepting it from 'waitfor' if that
+// is nonzero.  On success the CPU goes straight to the target, which
+// runs for the rest of our time slice, without a trip through the
+// scheduler's run queues.  But if we are not 'closed' and messages are
+// already queued for us, the target is merely made runnable and we take
+// the first of them straight away.
+//
+// If the target is not receiving, a 'closed' caller queues its message
+// as sys_ipc_send does and waits for the reply once it's taken.
+//
+// Returns < 0 on error, with nothing sent; see sys_ipc_try_send.
+// Also -E_INVAL if dstva < UTOP but dstva is not page-aligned, or if
+// envid is the caller.  On success it doesn't return here, but the
+// system call returns 0 once a message arrives.
+static int
+sys_ipc_send_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva, bool closed)
+{
+	struct Env* target_env;
+	bool busy;
+	int r;
+
+	if((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE != 0){
+		return -E_INVAL;
+	}
+
+	if((r=envid2env(envid,&target_env,false)) < 0){
+		return r;
+	}
+
+	if(target_env == curenv){
+		return -E_INVAL;
+	}
+
+	envid=target_env->env_id;
+	env_lock2(curenv,target_env);
+	//Nobody can queue on us while we hold our lock
+	busy=!closed && curenv->env_ipc_sendq_head != NULL;
+	r=sys_ipc_try_send_locked(target_env,envid,value,srcva,perm,!busy);
+	//A dying caller doesn't wait; env_run and sched_yield reap it
+	if(curenv->env_status != ENV_DYING){
+		curenv->env_ipc_waitfor=closed ? envid : 0;
+		curenv->env_ipc_dstva=dstva;
+		if(r == 0 && !busy){
+			curenv->env_ipc_recving=true;
+			env_set_status(curenv,ENV_NOT_RUNNABLE);
+		}else if(r == -E_IPC_NOT_RECV && closed){
+			ipc_queue_send(target_env,value,srcva,perm,true);
+			env_unlock2(curenv,target_env);
+			sched_yield();
 		}
 	}
+	env_unlock2(curenv,target_env);
 
-	//Start sending
-	//Send value
-	target_env->env_ipc_recving=false;
-	target_env->env_ipc_from=curenv->env_id;
-	target_env->env_ipc_value=value;
+	if(r < 0){
+		return r;
+	}
+	if(!busy){
+		env_run(target_env);
+	}
 
-	//Transfer page
-	if((uintptr_t)srcva < UTOP && (uintptr_t)target_env->env_ipc_dstva < UTOP){
-		target_env->env_ipc_perm=perm;
+	return sys_ipc_recv_timeout(dstva,TIME_NEVER);
+}
 
-		//Start map page
-		struct PageInfo* pp;
-		if((pp=page_lookup(curenv->env_pgdir,srcva,NULL)) == NULL){
-			//No page found in srcva
-			return -E_INVAL;
+// Call a server: send it a request and wait for its reply, which
+// only it may send.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	return sys_ipc_send_wait(envid,value,srcva,perm,dstva,true);
+}
+
+// Reply to a client blocked in sys_ipc_call, and wait for the next
+// request from anyone.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	return sys_ipc_send_wait(envid,value,srcva,perm,dstva,false);
+}
+
+// Block until a value is ready or time_msec() reaches 'deadline',
+// whichever comes first.  A deadline of TIME_NEVER (~0) never comes.
+//
+// If 'dstva' is < UTOP, then you are willing to receive a page of data.
+// 'dstva' is the virtual address at which the sent page should be mapped.
+//
+// This function only returns on error, but the system call will eventually
+// return 0 on success.
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if the deadline passed before a value arrived.
+static int
+sys_ipc_recv_timeout(void *dstva, unsigned deadline)
+{
+	uintptr_t dstva_int=(uintptr_t)dstva;
+	if(dstva_int < UTOP && dstva_int%PGSIZE != 0){
+		return -E_INVAL;
+	}
+
+	if(deadline != TIME_NEVER && deadline <= time_msec()){
+		return -E_TIMEOUT;
+	}
+
+	//Once we unlock, a sender may wake us and another CPU may run us,
+	//so everything must be set up before that.
+	//A sender overwrites the -E_TIMEOUT with 0
+	while(true){
+		env_lock(curenv);
+		//A dying env must not block; sched_yield reaps it
+		if(curenv->env_status == ENV_DYING){
+			env_unlock(curenv);
+			sched_yield();
 		}
+		curenv->env_ipc_waitfor=0;
+		curenv->env_ipc_dstva=dstva;
+		//Nobody can queue on us while we hold our lock
+		if(curenv->env_ipc_sendq_head == NULL){
+			break;
+		}
+		env_unlock(curenv);
 
-		if((r=page_insert(target_env->env_pgdir,pp,target_env->env_ipc_dstva,perm))<0){
-			return r;
+		//Blocked senders go first
+		if(ipc_recv_queued()){
+			return 0;
 		}
-	}else{
-		//No page transfer happend, just set perm 0
-		target_env->env_ipc_perm=0;
 	}
+	curenv->env_ipc_recving=true;
+	curenv->env_tf.tf_regs.reg_eax=-E_TIMEOUT;
+	env_set_status(curenv,ENV_NOT_RUNNABLE);
+	if(deadline != TIME_NEVER){
+		sched_sleep(curenv,deadline);
+	}
+	env_unlock(curenv);
 
-	//Page mapped, now we need to set the return value and mark it runnable
-	target_env->env_tf.tf_regs.reg_eax=0;
-	target_env->env_status=ENV_RUNNABLE;
+	sched_yield();
 
 	return 0;
-
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -478,20 +1207,236 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
-	uintptr_t dstva_int=(uintptr_t)dstva;
-	if(dstva_int < UTOP && dstva_int%PGSIZE != 0){
+	return sys_ipc_recv_timeout(dstva,TIME_NEVER);
+}
+
+// Block until time_msec() reaches 'msec', without using the CPU
+// meanwhile.  Returns 0 right away if that time has already passed.
+static int
+sys_sleep_until(unsigned msec)
+{
+	if(msec <= time_msec()){
+		return 0;
+	}
+
+	env_lock(curenv);
+	if(curenv->env_status == ENV_DYING){
+		env_unlock(curenv);
+		sched_yield();
+	}
+	curenv->env_tf.tf_regs.reg_eax=0;
+	env_set_status(curenv,ENV_NOT_RUNNABLE);
+	sched_sleep(curenv,msec);
+	env_unlock(curenv);
+
+	sched_yield();
+
+	return 0;
+}
+
+// Block until the device interrupt 'irq' fires, or time_msec() reaches
+// 'deadline' (TIME_NEVER for no deadline), for a device driver in user
+// space.  The first wait for an IRQ unmasks it and makes curenv the env
+// it goes to.  An interrupt that fires while curenv isn't waiting is
+// kept for its next wait, which then returns right away; the driver
+// should check the device, since that interrupt may be a stale one.
+// Only envs with I/O privilege may take interrupts.
+//
+// Returns 0 when the interrupt fired, < 0 on error.  Errors are:
+//	-E_INVAL if irq isn't one envs may take, or curenv has no I/O
+//		privilege.
+//	-E_TIMEOUT if the deadline passed first.
+static int
+sys_irq_wait(unsigned irq, unsigned deadline)
+{
+	if(irq >= 16 || !(irq_env_mask & (1<<irq)) ||
+	   (curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3){
 		return -E_INVAL;
 	}
 
-	curenv->env_status=ENV_NOT_RUNNABLE;
-	curenv->env_ipc_recving=true;
-	curenv->env_ipc_dstva=dstva;
+	if(irq_env[irq] != curenv->env_id){
+		irq_env[irq]=curenv->env_id;
+		irq_setmask_8259A(irq_mask_8259A & ~(1<<irq));
+	}
+
+	env_lock(curenv);
+	if(curenv->env_status == ENV_DYING){
+		env_unlock(curenv);
+		sched_yield();
+	}
+	if(curenv->env_irq_pending & (1<<irq)){
+		curenv->env_irq_pending &= ~(1<<irq);
+		env_unlock(curenv);
+		return 0;
+	}
+	if(deadline != TIME_NEVER && deadline <= time_msec()){
+		env_unlock(curenv);
+		return -E_TIMEOUT;
+	}
+
+	//irq_notify overwrites the -E_TIMEOUT with 0
+	curenv->env_irq_wait=1<<irq;
+	curenv->env_tf.tf_regs.reg_eax=-E_TIMEOUT;
+	env_set_status(curenv,ENV_NOT_RUNNABLE);
+	if(deadline != TIME_NEVER){
+		sched_sleep(curenv,deadline);
+	}
+	env_unlock(curenv);
 
 	sched_yield();
 
 	return 0;
 }
 
+// Resolve a not-present fault by curenv at 'va' in one of its
+// demand-paged regions.  A page past the region's file data is
+// allocated zeroed on the spot.  For a page of file data, curenv
+// blocks and sends the region's pager an IPC_PAGEIN message, which
+// the pager answers with sys_pagein; then this doesn't return, and
+// curenv retries the faulting instruction once the page is in.
+//
+// Returns 0 if the page is now mapped, or < 0 if va isn't in a region
+// or the pager can't be asked, for the usual fault handling.
+int
+region_fault(uintptr_t va)
+{
+	struct EnvRegion rg;
+	struct PageInfo *pp;
+	struct Env *pager;
+	envid_t pagerid;
+	uint32_t eax;
+	int i,r;
+
+	va=ROUNDDOWN(va,PGSIZE);
+	env_lock(curenv);
+	curenv->env_pagein_region=-1;
+	for(i=0;i<NENVREGION;i++){
+		rg=curenv->env_regions[i];
+		if(rg.er_memsz != 0 && va >= rg.er_va && va - rg.er_va < rg.er_memsz){
+			break;
+		}
+	}
+	env_unlock(curenv);
+	if(i == NENVREGION){
+		return -E_INVAL;
+	}
+
+	if(va - rg.er_va >= ROUNDUP(rg.er_filesz,PGSIZE)){
+		if((pp=page_alloc(ALLOC_ZERO)) == NULL){
+			return -E_NO_MEM;
+		}
+		env_lock(curenv);
+		r=page_insert(curenv->env_pgdir,pp,(void*)va,rg.er_perm);
+		env_unlock(curenv);
+		if(r < 0){
+			page_free(pp);
+		}
+		return r;
+	}
+
+	if((r=envid2env(rg.er_pager,&pager,false)) < 0){
+		return r;
+	}
+	if(pager == curenv){
+		return -E_INVAL;
+	}
+
+	pagerid=pager->env_id;
+	env_lock2(curenv,pager);
+	curenv->env_pagein_region=i;
+	curenv->env_pagein_va=va;
+	r=sys_ipc_try_send_locked(pager,pagerid,IPC_PAGEIN,(void*)UTOP,0,true);
+	//A dying env doesn't wait; env_run and sched_yield reap it
+	if(curenv->env_status != ENV_DYING){
+		if(r == 0){
+			//The pager has the request; wait for its sys_pagein
+			spin_lock(&sendq_lock);
+			env_pagein_push(pager,curenv);
+			spin_unlock(&sendq_lock);
+			env_set_status(curenv,ENV_NOT_RUNNABLE);
+		}else if(r == -E_IPC_NOT_RECV){
+			//If the pager dies we wake up to fault again, so the
+			//registers must be left as they were at the fault
+			eax=curenv->env_tf.tf_regs.reg_eax;
+			ipc_queue_send(pager,IPC_PAGEIN,(void*)UTOP,0,false);
+			curenv->env_ipc_send_pagein=true;
+			curenv->env_tf.tf_regs.reg_eax=eax;
+			env_unlock2(curenv,pager);
+			sched_yield();
+		}
+	}
+	env_unlock2(curenv,pager);
+
+	if(r < 0){
+		curenv->env_pagein_region=-1;
+		return r;
+	}
+	env_run(pager);
+}
+
+// Answer envid's IPC_PAGEIN request: map our page at 'srcva' at the
+// page envid waits for, with its region's permissions, and let envid
+// run again.  Only the pager of that region may do this.  With srcva
+// >= UTOP the pager gives up instead, and envid is destroyed, as
+// though its fault had gone unhandled.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if envid doesn't currently exist, or isn't waiting
+//		on a page from the caller.
+//	-E_INVAL if srcva < UTOP but is not page-aligned or not mapped,
+//		or is read-only and the region is writable.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_pagein(envid_t envid, void *srcva)
+{
+	struct EnvRegion *rg;
+	struct PageInfo *pp;
+	struct Env *e;
+	pte_t *pte;
+	bool kill=false;
+	int r;
+
+	if((uintptr_t)srcva < UTOP && (uintptr_t)srcva % PGSIZE != 0){
+		return -E_INVAL;
+	}
+
+	if((r=envid2env(envid,&e,false)) < 0){
+		return r;
+	}
+	if(e == curenv){
+		return -E_INVAL;
+	}
+
+	envid=e->env_id;
+	env_lock2(curenv,e);
+	//e is on our list once we've taken its IPC_PAGEIN, and only then
+	if(!env_is_live(e,envid) || e->env_pagein_pager != curenv->env_id){
+		r=-E_BAD_ENV;
+	}else if((uintptr_t)srcva >= UTOP){
+		kill=true;
+	}else{
+		rg=&e->env_regions[e->env_pagein_region];
+		if((pp=page_lookup(curenv->env_pgdir,srcva,&pte)) == NULL ||
+		   ((rg->er_perm & PTE_W) && !(*pte & PTE_W))){
+			r=-E_INVAL;
+		}else if((r=page_insert(e->env_pgdir,pp,(void*)e->env_pagein_va,rg->er_perm)) == 0){
+			spin_lock(&sendq_lock);
+			env_pagein_remove(e);
+			spin_unlock(&sendq_lock);
+			e->env_pagein_region=-1;
+			env_set_status(e,ENV_RUNNABLE);
+		}
+	}
+	env_unlock2(curenv,e);
+
+	if(kill){
+		cprintf("[%08x] pager %08x failed va %08x\n",
+			envid,curenv->env_id,e->env_pagein_va);
+		env_destroy(e);
+	}
+	return r;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -555,6 +1500,116 @@ sys_try_receive_packet(void* buf){
 	return r;
 }
 
+// Return the physical address of the page curenv maps at 'va', for a
+// device driver to point DMA at.  The page must stay mapped for as
+// long as the device uses it.  Only envs with I/O privilege may ask.
+// Return < 0 means error, errors are:
+//  -E_INVAL if va is above UTOP, or curenv has no I/O privilege
+//  -E_FAULT if nothing is mapped at va
+static int
+sys_page_physaddr(void* va){
+	pte_t* pte;
+
+	if((uintptr_t)va >= UTOP ||
+	   (curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3){
+		return -E_INVAL;
+	}
+
+	if(page_lookup(curenv->env_pgdir,va,&pte) == NULL){
+		return -E_FAULT;
+	}
+	return PTE_ADDR(*pte) + (uintptr_t)va % PGSIZE;
+}
+
+// Return the I/O base of the IDE controller's bus-master registers,
+// which pci_init found, or -E_NOT_FOUND if there is no IDE controller
+// that can do DMA.
+static int
+sys_ide_dma_base(void){
+	if(pci_ide_bmbase == 0){
+		return -E_NOT_FOUND;
+	}
+	return pci_ide_bmbase;
+}
+
+// Return the IRQ of the virtio disk, which the file server takes with
+// sys_irq_wait to wait for its requests, or -E_NOT_FOUND if there is
+// no virtio disk.
+static int
+sys_blk_probe(void){
+	if((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3){
+		return -E_INVAL;
+	}
+	return virtio_blk_irq();
+}
+
+// Queue a request for the virtio disk to read ('write' false) or write
+// the nsecs sectors from secno on, into or from curenv's memory at va.
+// The request runs while curenv goes on, and holds a reference to each
+// page of the memory until sys_blk_poll says it is done, or until the
+// device is through with it if curenv dies first.
+//
+// Returns the request's tag (>= 0), or < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege, or nsecs is 0 or too big,
+//		or the sectors are past the end of the disk.
+//	-E_FAULT if the memory isn't mapped, or isn't writable for a read.
+//	-E_NOT_FOUND if there is no virtio disk.
+//	-E_DEVICE_BUSY if the disk has too many requests for now.
+static int
+sys_blk_submit(uint32_t secno, void* va, size_t nsecs, bool write){
+	struct virtio_blk_seg segs[VIRTIO_BLK_SEG_MAX];
+	struct PageInfo* pp;
+	uintptr_t p,end;
+	int nsegs=0,r;
+	pte_t* pte;
+
+	if((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3 ||
+	   nsecs == 0 || nsecs > 256){
+		return -E_INVAL;
+	}
+	end=(uintptr_t)va+nsecs*512;
+	if(end > UTOP || end < (uintptr_t)va){
+		return -E_FAULT;
+	}
+
+	//One piece per page, since the pages needn't be contiguous
+	for(p=(uintptr_t)va;p<end;p=ROUNDDOWN(p,PGSIZE)+PGSIZE){
+		if((pp=page_lookup(curenv->env_pgdir,(void*)p,&pte)) == NULL ||
+		   !(*pte & PTE_U) || (!write && !(*pte & PTE_W))){
+			r=-E_FAULT;
+			goto fail;
+		}
+		//The device uses the page even if curenv unmaps it or dies
+		page_incref(pp);
+		segs[nsegs].pa=PTE_ADDR(*pte)+p%PGSIZE;
+		segs[nsegs].len=MIN(end,ROUNDDOWN(p,PGSIZE)+PGSIZE)-p;
+		segs[nsegs].pp=pp;
+		nsegs++;
+	}
+	if((r=virtio_blk_submit(secno,segs,nsegs,write,curenv->env_id)) >= 0){
+		return r;
+	}
+
+fail:
+	while(nsegs > 0){
+		page_decref(segs[--nsegs].pp);
+	}
+	return r;
+}
+
+// Check on the virtio disk request 'tag' from sys_blk_submit.
+// Returns 0 once it is done, and forgets it and drops the references to
+// its pages; 1 while it is in flight;
+// or < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege, or there is no such request.
+//	-E_UNSPECIFIED if the disk failed the request.
+static int
+sys_blk_poll(int tag){
+	if((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3){
+		return -E_INVAL;
+	}
+	return virtio_blk_poll(tag,curenv->env_id);
+}
 
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
@@ -606,6 +1661,42 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_transmit_packet((void*)a1,a2);
 	case SYS_try_receive_packet:
 		return sys_try_receive_packet((void*)a1);
+	case SYS_sleep_until:
+		return sys_sleep_until(a1);
+	case SYS_ipc_recv_timeout:
+		return sys_ipc_recv_timeout((void*)a1,a2);
+	case SYS_ipc_call:
+		return sys_ipc_call(a1,a2,(void*)a3,a4,(void*)a5);
+	case SYS_ipc_reply_wait:
+		return sys_ipc_reply_wait(a1,a2,(void*)a3,a4,(void*)a5);
+	case SYS_ipc_send:
+		return sys_ipc_send(a1,a2,(void*)a3,a4);
+	case SYS_fork:
+		return sys_fork();
+	case SYS_page_alloc_range:
+		return sys_page_alloc_range(a1,a2,a3,a4);
+	case SYS_page_map_range:
+		return sys_page_map_range(a1,a2,a3,a4,a5);
+	case SYS_page_unmap_range:
+		return sys_page_unmap_range(a1,a2,a3);
+	case SYS_page_batch:
+		return sys_page_batch((const struct PageOp*)a1,a2);
+	case SYS_env_add_region:
+		return sys_env_add_region(a1,(const struct EnvRegion*)a2);
+	case SYS_pagein:
+		return sys_pagein(a1,(void*)a2);
+	case SYS_irq_wait:
+		return sys_irq_wait(a1,a2);
+	case SYS_page_physaddr:
+		return sys_page_physaddr((void*)a1);
+	case SYS_ide_dma_base:
+		return sys_ide_dma_base();
+	case SYS_blk_probe:
+		return sys_blk_probe();
+	case SYS_blk_submit:
+		return sys_blk_submit(a1,(void*)a2,a3,a4);
+	case SYS_blk_poll:
+		return sys_blk_poll(a1);
 	default:
 		return -E_INVAL;
 	}
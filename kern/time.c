@@ -1,26 +1,46 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+static uint64_t tsc_base;	// TSC at time_init()
+static uint32_t tsc_per_ms;	// TSC ticks per millisecond
 
 void
 time_init(void)
 {
-	ticks = 0;
+	lapic_timer_calibrate(&tsc_per_ms);
+	tsc_base = read_tsc();
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// Milliseconds since time_init(), read from the TSC so that any CPU
+// can tell the time without a periodic tick.
+unsigned int
+time_msec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	if (tsc_per_ms == 0)
+		return 0;
+	return (read_tsc() - tsc_base) / tsc_per_ms;
 }
 
-unsigned int
-time_msec(void)
+// Program this CPU's timer to interrupt at time 'deadline' (in
+// time_msec() units), or stop it if deadline is TIME_NEVER.
+// A deadline that has already passed fires right away.
+void
+time_arm(unsigned int deadline)
 {
-	return ticks * 10;
+	unsigned int now;
+
+	if (deadline == TIME_NEVER) {
+		lapic_timer_oneshot(0);
+		return;
+	}
+
+	now = time_msec();
+	if (deadline <= now)
+		lapic_timer_oneshot(1);
+	else if (deadline - now < 0xFFFFFFFF / 1000)
+		lapic_timer_oneshot((deadline - now) * 1000);
+	else
+		lapic_timer_oneshot(0xFFFFFFFF);
 }
@@ -4,8 +4,10 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#define TIME_NEVER	(~0U)	// A deadline that never comes
+
 void time_init(void);
-void time_tick(void);
 unsigned int time_msec(void);
+void time_arm(unsigned int deadline);
 
 #endif /* JOS_KERN_TIME_H */
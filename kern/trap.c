@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/virtio.h>
 
 // static struct Taskstate ts;
 
@@ -23,6 +24,13 @@
  */
 static struct Trapframe *last_tf;
 
+// The env each device IRQ goes to, the last to sys_irq_wait for it
+envid_t irq_env[16];
+
+// IRQs that envs may take with sys_irq_wait: IDE, and the PCI IRQs of
+// the drivers that set up a device for an env, see virtio_blk_attach
+uint16_t irq_env_mask = 1<<IRQ_IDE;
+
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
  */
@@ -92,8 +100,15 @@ extern char irq_timer_handler[];
 extern char irq_kbd_handler[];
 extern char irq_serial_handler[];
 extern char irq_spurious_handler[];
+extern char irq_pci9_handler[];
+extern char irq_pci10_handler[];
+extern char irq_pci11_handler[];
 extern char irq_ide_handler[];
 extern char irq_error_handler[];
+extern char irq_wakeup_handler[];
+extern char irq_tlb_handler[];
+
+extern char sysenter_handler[];
 
 
 void
@@ -127,8 +142,13 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET+IRQ_KBD],false,GD_KT,irq_kbd_handler,0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_SERIAL],false,GD_KT,irq_serial_handler,0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_SPURIOUS],false,GD_KT,irq_spurious_handler,0);
+	SETGATE(idt[IRQ_OFFSET+9],false,GD_KT,irq_pci9_handler,0);
+	SETGATE(idt[IRQ_OFFSET+10],false,GD_KT,irq_pci10_handler,0);
+	SETGATE(idt[IRQ_OFFSET+11],false,GD_KT,irq_pci11_handler,0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_IDE],false,GD_KT,irq_ide_handler,0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_ERROR],false,GD_KT,irq_error_handler,0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_WAKEUP],false,GD_KT,irq_wakeup_handler,0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_TLB],false,GD_KT,irq_tlb_handler,0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -186,6 +206,17 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Fast system calls: sysenter switches to this CPU's kernel stack
+	// and jumps to sysenter_handler.  sysexit derives the user
+	// segments from GD_KT, see inc/memlayout.h.
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_SEP) {
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, this_ts->ts_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -234,6 +265,31 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// Deliver 'irq' to the env it goes to: wake the env if it is blocked
+// in sys_irq_wait for it, or else note it for the env's next wait.
+static void
+irq_notify(int irq)
+{
+	envid_t envid = irq_env[irq];
+	struct Env *e = &envs[ENVX(envid)];
+
+	if(envid == 0){
+		return;
+	}
+
+	env_lock(e);
+	if(e->env_id == envid && e->env_status != ENV_DYING){
+		e->env_irq_pending |= 1<<irq;
+		if(e->env_irq_wait & e->env_irq_pending){
+			e->env_irq_pending &= ~e->env_irq_wait;
+			e->env_irq_wait=0;
+			e->env_tf.tf_regs.reg_eax=0;
+			env_set_status(e,ENV_RUNNABLE);
+		}
+	}
+	env_unlock(e);
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -271,13 +327,34 @@ trap_dispatch(struct Trapframe *tf)
 		tf->tf_regs.reg_eax=ret;
 		return;
 	}else if(tf->tf_trapno == IRQ_OFFSET+IRQ_TIMER){
-		//Only allow cpu 0 to put forward clock
-		if(cpunum()==0){
-			time_tick();
-		}
-
+		//The one-shot timer fired: a deadline has passed.
+		//sched_yield rearms it for the next one
+		lapic_eoi();
+		sched_yield();
+	}else if(tf->tf_trapno == IRQ_OFFSET+IRQ_WAKEUP){
+		//Another CPU queued work while we were halted
 		lapic_eoi();
 		sched_yield();
+	}else if(tf->tf_trapno == IRQ_OFFSET+IRQ_TLB){
+		//Another CPU changed the page tables we have loaded
+		lapic_eoi();
+		tlb_shootdown_poll();
+		return;
+	}else if(tf->tf_trapno == IRQ_OFFSET+IRQ_IDE){
+		//The file server drives the disk
+		lapic_eoi();
+		irq_notify(IRQ_IDE);
+		return;
+	}else if(tf->tf_trapno >= IRQ_OFFSET+IRQ_PCI_FIRST &&
+		 tf->tf_trapno <= IRQ_OFFSET+IRQ_PCI_LAST){
+		//The kernel acks the virtio disk, whose requests the file
+		//server then collects
+		lapic_eoi();
+		if(tf->tf_trapno == IRQ_OFFSET+virtio_blk_irq()){
+			virtio_blk_intr();
+		}
+		irq_notify(tf->tf_trapno-IRQ_OFFSET);
+		return;
 	}else if(tf->tf_trapno == IRQ_OFFSET+IRQ_KBD){
 		lapic_eoi();
 		kbd_intr();
@@ -319,10 +396,9 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We may have been halted in sched_yield(); we're running again
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -330,19 +406,12 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
-
 		assert(curenv);
 
-		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+		// Garbage collect if current enviroment is a zombie;
+		// sched_yield() reaps it under its lock.
+		if (curenv->env_status == ENV_DYING)
 			sched_yield();
-		}
 
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
@@ -362,12 +431,64 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	if (curenv && env_running_here(curenv))
 		env_run(curenv);
 	else
 		sched_yield();
 }
 
+// The sysenter counterpart of trap() for T_SYSCALL.  Instead of a full
+// Trapframe copy it saves into curenv->env_tf only what env_pop_tf()
+// needs to resume the env should the syscall block or reschedule.
+// Otherwise it returns the syscall's result and sysenter_handler
+// goes straight back to user mode with sysexit.
+int32_t
+sysenter_trap(struct Sysframe *sf)
+{
+	struct Trapframe *tf;
+	int32_t ret;
+
+	assert(!(read_eflags() & FL_IF));
+	assert(curenv);
+
+	if (curenv->env_status == ENV_DYING)
+		sched_yield();
+
+	user_mem_assert(curenv, (void *) sf->sf_esp, 4, PTE_U);
+	sf->sf_eip = *(uint32_t *) sf->sf_esp;
+
+	// The same registers sysexit would leave behind
+	tf = &curenv->env_tf;
+	tf->tf_regs.reg_eax = sf->sf_eax;
+	tf->tf_regs.reg_edx = sf->sf_eip;
+	tf->tf_regs.reg_ecx = sf->sf_esp;
+	tf->tf_regs.reg_ebx = sf->sf_ebx;
+	tf->tf_regs.reg_edi = sf->sf_edi;
+	tf->tf_regs.reg_esi = sf->sf_esi;
+	tf->tf_regs.reg_ebp = sf->sf_esp;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_eip = sf->sf_eip;
+	tf->tf_esp = sf->sf_esp;
+	// sysenter leaves the env's IOPL alone, and so must we
+	tf->tf_eflags = FL_IF | (tf->tf_eflags & FL_IOPL_MASK);
+	tf->tf_cs = GD_UT | 3;
+	tf->tf_ss = tf->tf_ds = tf->tf_es = GD_UD | 3;
+	last_tf = tf;
+
+	ret = syscall(sf->sf_eax, sf->sf_edx, sf->sf_ecx, sf->sf_ebx,
+		      sf->sf_edi, sf->sf_esi);
+	tf->tf_regs.reg_eax = ret;
+
+	if (curenv && env_running_here(curenv)) {
+		// A trapframe the env set for itself only takes effect
+		// through env_pop_tf()
+		if (sf->sf_eax == SYS_env_set_trapframe)
+			env_run(curenv);
+		return ret;
+	}
+	sched_yield();
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -388,6 +509,26 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Copy-on-write faults are resolved here without bothering the
+	// env; trap() resumes it.  If that fails for want of memory, the
+	// upcall gets its chance.
+	if(tf->tf_err & FEC_WR){
+		int r;
+
+		env_lock(curenv);
+		r=page_cow(curenv->env_pgdir,(void*)fault_va);
+		env_unlock(curenv);
+		if(r == 0){
+			return;
+		}
+	}
+
+	// So are faults on pages of demand-paged regions that aren't in
+	// yet, though the env may have to wait for its pager.
+	if(!(tf->tf_err & FEC_PR) && region_fault(fault_va) == 0){
+		return;
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
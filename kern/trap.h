@@ -8,6 +8,23 @@
 
 #include <inc/trap.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
+
+/* Saved by sysenter_handler in kern/trapentry.S */
+struct Sysframe {
+	uint32_t sf_eax;	/* Syscall number */
+	uint32_t sf_edx;	/* Arguments */
+	uint32_t sf_ecx;
+	uint32_t sf_ebx;
+	uint32_t sf_edi;
+	uint32_t sf_esi;
+	uint32_t sf_esp;	/* User %esp, passed in %ebp */
+	uint32_t sf_eip;	/* Return address, from the user stack */
+};
+
+/* The env each device IRQ is delivered to, see sys_irq_wait */
+extern envid_t irq_env[16];
+extern uint16_t irq_env_mask;
 
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
@@ -15,6 +32,7 @@ extern struct Pseudodesc idt_pd;
 
 void trap_init(void);
 void trap_init_percpu(void);
+int32_t sysenter_trap(struct Sysframe *sf);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
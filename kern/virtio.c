@@ -0,0 +1,370 @@
+#include <kern/virtio.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/trap.h>
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+
+// A legacy virtio-blk device, driven for the file server.
+//
+// Unlike IDE, the device takes many requests at once: each one is a
+// chain of descriptors in the virtqueue, with the request header, one
+// descriptor per piece of the caller's buffer and the status byte.
+// The file server submits requests with sys_blk_submit, which returns
+// the chain's head as the request's tag, and collects them with
+// sys_blk_poll, sleeping in sys_irq_wait on the device's IRQ while
+// they are in flight.
+//
+// A request keeps its chain, and so its tag, until the poll that says
+// it's done, and holds a reference to each page the device reads or
+// writes until then.  If its env dies first, the request is orphaned
+// and forgotten once the device is through with it.
+
+// State of a request slot, indexed by the head of its chain
+enum {
+    VBLK_FREE = 0,
+    VBLK_INFLIGHT,
+    VBLK_DONE,
+};
+
+struct vblk_slot {
+    struct virtio_blk_req hdr;
+    uint8_t status;     // Written by the device
+    uint8_t state;
+    uint8_t npages;
+    envid_t owner;      // The env that submitted it, or 0 if it's dead
+    struct PageInfo *pages[VIRTIO_BLK_SEG_MAX];
+};
+
+static struct {
+    uint32_t iobase;            // 0 if there is no device
+    uint8_t irq;
+    uint16_t qsize;             // Descriptors in the queue
+    uint64_t capacity;          // In sectors
+
+    struct virtq_desc *desc;
+    volatile struct virtq_avail *avail;
+    volatile struct virtq_used *used;
+    uint16_t free_head;         // Free descriptors, chained by 'next'
+    uint16_t nfree;
+    uint16_t last_used;         // The next used entry we haven't seen
+    uint16_t norphans;          // Done requests whose env is dead
+
+    struct vblk_slot *slots;
+} vblk;
+
+static struct spinlock vblk_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "vblk_lock",
+    .rank = LOCK_RANK_VIRTIO
+#endif
+};
+
+// The smallest order of a block of pages that holds 'bytes'
+static int
+order_for(size_t bytes)
+{
+    int order = 0;
+
+    while ((PGSIZE << order) < bytes)
+        order++;
+    return order;
+}
+
+// Set up the first virtio-blk device with one virtqueue, and note its
+// IRQ for the file server to wait on.
+int
+virtio_blk_attach(struct pci_func *f)
+{
+    struct PageInfo *pp;
+    size_t availsz, usedsz;
+    uint32_t iobase;
+    int i;
+
+    if (vblk.iobase)
+        return 0;
+
+    pci_func_enable(f);
+    iobase = f->reg_base[0];
+    if (iobase == 0 || f->irq_line < IRQ_PCI_FIRST || f->irq_line > IRQ_PCI_LAST) {
+        cprintf("virtio-blk: no I/O BAR, or irq %d we can't take\n", f->irq_line);
+        return 0;
+    }
+
+    // Reset, then say we know what the device is
+    outb(iobase + VIRTIO_PCI_STATUS, 0);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    // Plain reads and writes need no features
+    outl(iobase + VIRTIO_PCI_GUEST_FEATURES, 0);
+
+    // The legacy queue's size is the device's, so size its memory to it
+    outw(iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+    vblk.qsize = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+    availsz = ROUNDUP(sizeof(struct virtq_desc) * vblk.qsize +
+                      sizeof(struct virtq_avail) + 2 * vblk.qsize + 2,
+                      VIRTIO_QUEUE_ALIGN);
+    usedsz = sizeof(struct virtq_used) +
+        sizeof(struct virtq_used_elem) * vblk.qsize + 2;
+    if (vblk.qsize == 0 ||
+        (pp = page_alloc_order(order_for(availsz + usedsz), ALLOC_ZERO)) == NULL) {
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return 0;
+    }
+    vblk.desc = page2kva(pp);
+    vblk.avail = (void *) vblk.desc + sizeof(struct virtq_desc) * vblk.qsize;
+    vblk.used = (void *) vblk.desc + availsz;
+
+    if ((pp = page_alloc_order(order_for(sizeof(struct vblk_slot) * vblk.qsize),
+                               ALLOC_ZERO)) == NULL) {
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return 0;
+    }
+    vblk.slots = page2kva(pp);
+
+    for (i = 0; i < vblk.qsize; i++)
+        vblk.desc[i].next = i + 1;
+    vblk.free_head = 0;
+    vblk.nfree = vblk.qsize;
+    vblk.last_used = 0;
+
+    outl(iobase + VIRTIO_PCI_QUEUE_PFN, PADDR(vblk.desc) / VIRTIO_QUEUE_ALIGN);
+    vblk.capacity = inl(iobase + VIRTIO_PCI_CONFIG) |
+        (uint64_t) inl(iobase + VIRTIO_PCI_CONFIG + 4) << 32;
+    outb(iobase + VIRTIO_PCI_STATUS,
+         VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    vblk.irq = f->irq_line;
+    vblk.iobase = iobase;
+    irq_env_mask |= 1 << vblk.irq;
+    cprintf("virtio-blk: %u sectors, queue of %d, irq %d\n",
+            (uint32_t) vblk.capacity, vblk.qsize, vblk.irq);
+    return 1;
+}
+
+// The IRQ to wait on for requests, or -E_NOT_FOUND if there's no device.
+int
+virtio_blk_irq(void)
+{
+    return vblk.iobase ? vblk.irq : -E_NOT_FOUND;
+}
+
+// Take a descriptor off the free list.  The caller holds vblk_lock
+// and has checked that there are enough.
+static uint16_t
+desc_alloc(void)
+{
+    uint16_t i = vblk.free_head;
+
+    vblk.free_head = vblk.desc[i].next;
+    vblk.nfree--;
+    return i;
+}
+
+// Note the requests the device has finished.  Their chains stay
+// allocated, so that their tags aren't reused, until vblk_forget.
+// The caller holds vblk_lock.
+static void
+vblk_collect(void)
+{
+    uint16_t head;
+
+    while (vblk.last_used != vblk.used->idx) {
+        head = vblk.used->ring[vblk.last_used % vblk.qsize].id;
+        vblk.slots[head].state = VBLK_DONE;
+        if (vblk.slots[head].owner == 0)
+            vblk.norphans++;
+        vblk.last_used++;
+    }
+}
+
+// Free the done request 'head' and its chain, and move the page
+// references it held into pages, returning how many there are.  The
+// caller holds vblk_lock, and drops the references after releasing it,
+// since page_lock ranks below vblk_lock.
+static int
+vblk_forget(uint16_t head, struct PageInfo **pages)
+{
+    struct vblk_slot *slot = &vblk.slots[head];
+    int n = slot->npages;
+    uint16_t i;
+
+    for (i = head; vblk.desc[i].flags & VIRTQ_DESC_F_NEXT; i = vblk.desc[i].next)
+        vblk.nfree++;
+    vblk.desc[i].next = vblk.free_head;
+    vblk.free_head = head;
+    vblk.nfree++;
+
+    memcpy(pages, slot->pages, n * sizeof(pages[0]));
+    slot->npages = 0;
+    slot->owner = 0;
+    slot->state = VBLK_FREE;
+    return n;
+}
+
+// Forget the done requests of dead envs, dropping their pages.
+// The caller doesn't hold vblk_lock.
+static void
+vblk_reap(void)
+{
+    struct PageInfo *pages[VIRTIO_BLK_SEG_MAX];
+    uint16_t head;
+    int n;
+
+    spin_lock(&vblk_lock);
+    vblk_collect();
+    for (head = 0; vblk.norphans > 0 && head < vblk.qsize; head++) {
+        if (vblk.slots[head].state != VBLK_DONE || vblk.slots[head].owner != 0)
+            continue;
+        n = vblk_forget(head, pages);
+        vblk.norphans--;
+
+        spin_unlock(&vblk_lock);
+        while (n > 0)
+            page_decref(pages[--n]);
+        spin_lock(&vblk_lock);
+    }
+    spin_unlock(&vblk_lock);
+}
+
+// Queue a request for env 'owner' to read ('write' false) or write the
+// nsegs pieces of memory in segs from sector secno on, and tell the
+// device.  The request takes over the caller's reference to each
+// piece's page if it's queued; otherwise the caller keeps them.
+// Return the request's tag (>= 0), if succeeded
+// Return < 0 means error, errors are:
+//  -E_NOT_FOUND if there is no device
+//  -E_INVAL if the sectors are past the end of the disk
+//  -E_DEVICE_BUSY if the queue is too full for now
+int
+virtio_blk_submit(uint32_t secno, const struct virtio_blk_seg *segs,
+                  int nsegs, bool write, envid_t owner)
+{
+    uint16_t head, prev, i;
+    uint32_t nbytes = 0;
+    int s;
+
+    if (!vblk.iobase)
+        return -E_NOT_FOUND;
+    for (s = 0; s < nsegs; s++)
+        nbytes += segs[s].len;
+    if (secno + (uint64_t) nbytes / 512 > vblk.capacity)
+        return -E_INVAL;
+
+    spin_lock(&vblk_lock);
+    if (vblk.nfree < nsegs + 2) {
+        spin_unlock(&vblk_lock);
+        return -E_DEVICE_BUSY;
+    }
+
+    head = desc_alloc();
+    vblk.slots[head].hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    vblk.slots[head].hdr.reserved = 0;
+    vblk.slots[head].hdr.sector = secno;
+    vblk.slots[head].status = 0xFF;
+    vblk.slots[head].state = VBLK_INFLIGHT;
+    vblk.slots[head].owner = owner;
+    vblk.slots[head].npages = nsegs;
+    vblk.desc[head].addr = PADDR(&vblk.slots[head].hdr);
+    vblk.desc[head].len = sizeof(struct virtio_blk_req);
+    vblk.desc[head].flags = VIRTQ_DESC_F_NEXT;
+
+    prev = head;
+    for (s = 0; s < nsegs; s++) {
+        i = desc_alloc();
+        vblk.slots[head].pages[s] = segs[s].pp;
+        vblk.desc[i].addr = segs[s].pa;
+        vblk.desc[i].len = segs[s].len;
+        vblk.desc[i].flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE);
+        vblk.desc[prev].next = i;
+        prev = i;
+    }
+
+    i = desc_alloc();
+    vblk.desc[i].addr = PADDR(&vblk.slots[head].status);
+    vblk.desc[i].len = 1;
+    vblk.desc[i].flags = VIRTQ_DESC_F_WRITE;
+    vblk.desc[prev].next = i;
+
+    // The device must see the chain before the ring entry, and that
+    // before the index
+    vblk.avail->ring[vblk.avail->idx % vblk.qsize] = head;
+    asm volatile("" ::: "memory");
+    vblk.avail->idx++;
+    asm volatile("" ::: "memory");
+    outw(vblk.iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+
+    spin_unlock(&vblk_lock);
+    return head;
+}
+
+// Check on env owner's request 'tag'.  A request that has finished is
+// forgotten, and the references to its pages dropped.
+// Return 0 if it finished successfully, 1 if it is still in flight
+// Return < 0 means error, errors are:
+//  -E_INVAL if owner has no such request
+//  -E_UNSPECIFIED if the device failed it
+int
+virtio_blk_poll(int tag, envid_t owner)
+{
+    struct PageInfo *pages[VIRTIO_BLK_SEG_MAX];
+    int r, n = 0;
+
+    if (!vblk.iobase || tag < 0 || tag >= vblk.qsize)
+        return -E_INVAL;
+
+    spin_lock(&vblk_lock);
+    vblk_collect();
+    if (vblk.slots[tag].owner != owner)
+        r = -E_INVAL;
+    else if (vblk.slots[tag].state == VBLK_INFLIGHT)
+        r = 1;
+    else if (vblk.slots[tag].state == VBLK_DONE) {
+        r = vblk.slots[tag].status == VIRTIO_BLK_S_OK ? 0 : -E_UNSPECIFIED;
+        n = vblk_forget(tag, pages);
+    } else
+        r = -E_INVAL;
+    spin_unlock(&vblk_lock);
+
+    while (n > 0)
+        page_decref(pages[--n]);
+    return r;
+}
+
+// The device interrupted: acknowledge it, which lowers its IRQ line,
+// and note what it finished.  The caller wakes the file server.
+void
+virtio_blk_intr(void)
+{
+    if (!vblk.iobase)
+        return;
+    inb(vblk.iobase + VIRTIO_PCI_ISR);
+    vblk_reap();
+}
+
+// Env 'owner' is being freed: orphan its requests.  The device may
+// still be using their pages, so those that are in flight keep them
+// until it's done.
+void
+virtio_blk_env_free(envid_t owner)
+{
+    uint16_t head;
+
+    if (!vblk.iobase)
+        return;
+
+    spin_lock(&vblk_lock);
+    vblk_collect();
+    for (head = 0; head < vblk.qsize; head++) {
+        if (vblk.slots[head].state == VBLK_FREE || vblk.slots[head].owner != owner)
+            continue;
+        vblk.slots[head].owner = 0;
+        if (vblk.slots[head].state == VBLK_DONE)
+            vblk.norphans++;
+    }
+    spin_unlock(&vblk_lock);
+    vblk_reap();
+}
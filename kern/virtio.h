@@ -0,0 +1,88 @@
+#include <kern/pci.h>
+#include <kern/pmap.h>
+#include <inc/env.h>
+
+#ifndef JOS_KERN_VIRTIO_H
+#define JOS_KERN_VIRTIO_H
+
+// Registers of a legacy virtio PCI device, in its I/O BAR 0
+#define VIRTIO_PCI_HOST_FEATURES    0x00    // Features the device offers
+#define VIRTIO_PCI_GUEST_FEATURES   0x04    // Features we use
+#define VIRTIO_PCI_QUEUE_PFN        0x08    // Page number of the selected queue
+#define VIRTIO_PCI_QUEUE_NUM        0x0C    // Size of the selected queue
+#define VIRTIO_PCI_QUEUE_SEL        0x0E    // Queue selector
+#define VIRTIO_PCI_QUEUE_NOTIFY     0x10    // Tell the device a queue has work
+#define VIRTIO_PCI_STATUS           0x12    // Device status
+#define VIRTIO_PCI_ISR              0x13    // Interrupt status; reading acks
+#define VIRTIO_PCI_CONFIG           0x14    // Device-specific configuration
+
+// Device status bits
+#define VIRTIO_STATUS_ACK           0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FAILED        0x80
+
+// A legacy virtqueue's used ring starts on a page boundary
+#define VIRTIO_QUEUE_ALIGN          PGSIZE
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT           1   // The chain goes on at 'next'
+#define VIRTQ_DESC_F_WRITE          2   // The device writes the buffer
+
+struct virtq_desc {
+    uint64_t addr;      // Physical address of the buffer
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;       // Where we put the next chain head, mod the size
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;        // Head of the finished chain
+    uint32_t len;       // Bytes the device wrote
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;       // Where the device puts the next one
+    struct virtq_used_elem ring[];
+};
+
+// A virtio-blk request starts with this header and ends with a status
+// byte, with the data in between
+#define VIRTIO_BLK_T_IN             0   // Read
+#define VIRTIO_BLK_T_OUT            1   // Write
+
+#define VIRTIO_BLK_S_OK             0
+
+struct virtio_blk_req {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;    // In 512-byte units
+};
+
+// At most this many pieces of memory per request: 256 sectors that
+// needn't start on a page boundary
+#define VIRTIO_BLK_SEG_MAX          (256 * 512 / PGSIZE + 1)
+
+struct virtio_blk_seg {
+    physaddr_t pa;
+    uint32_t len;
+    struct PageInfo *pp;    // The page it's in, whose reference the
+                            // request takes over
+};
+
+int virtio_blk_attach(struct pci_func *f);
+int virtio_blk_irq(void);
+int virtio_blk_submit(uint32_t secno, const struct virtio_blk_seg *segs,
+                      int nsegs, bool write, envid_t owner);
+int virtio_blk_poll(int tag, envid_t owner);
+void virtio_blk_intr(void);
+void virtio_blk_env_free(envid_t owner);
+
+#endif  // !JOS_KERN_VIRTIO_H
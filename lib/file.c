@@ -4,8 +4,30 @@
 
 #define debug 0
 
+// Where devfile_read maps the block cache pages it reads
+#define READMAPVA	(PFTEMP - PGSIZE)
+
+// Where mmap finds room for its mappings
+#define MMAPBASE	0x60000000
+#define MMAPTOP		0xA0000000
+
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Send the page at 'pg' to the file server with request code 'type',
+// and wait for a reply, which maps a page at dstva unless it is 0.
+static int
+fsipc_page(unsigned type, void *pg, int perm, void *dstva)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)pg);
+
+	return ipc_call(fsenv, type, pg, perm, dstva, NULL);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,17 +37,18 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+	return fsipc_page(type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Is buf's page private and writable, so that we may change how it is
+// mapped, or map another page in its place, without anyone noticing?
+static bool
+page_is_private(const void *buf)
+{
+	return (uvpd[PDX(buf)] & PTE_P) &&
+		(uvpt[PGNUM(buf)] & (PTE_P | PTE_W | PTE_SHARE)) == (PTE_P | PTE_W);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -103,6 +126,16 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Map the block of 'fd' at the block-aligned 'offset' at 'dstva'; see
+// file_read_map.
+static int
+devfile_read_map(struct Fd *fd, off_t offset, void *dstva)
+{
+	fsipcbuf.read_map.req_fileid = fd->fd_file.id;
+	fsipcbuf.read_map.req_offset = offset;
+	return fsipc(FSREQ_READ_MAP, dstva);
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -117,6 +150,18 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	// A whole block is mapped from the server's block cache instead,
+	// and then mapped over buf if buf has the whole page, or copied
+	if (n >= BLKSIZE && fd->fd_offset % BLKSIZE == 0 &&
+	    (r = devfile_read_map(fd, fd->fd_offset, (void *) READMAPVA)) > 0) {
+		if ((uintptr_t) buf % PGSIZE != 0 || !page_is_private(buf) ||
+		    sys_page_map(0, (void *) READMAPVA, 0, buf, PTE_P|PTE_U|PTE_COW) < 0)
+			memmove(buf, (void *) READMAPVA, BLKSIZE);
+		sys_page_unmap(0, (void *) READMAPVA);
+		fd->fd_offset += BLKSIZE;
+		return BLKSIZE;
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -143,6 +188,18 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// LAB 5: Your code here
 	int r;
 
+	//A whole page-aligned block is handed over instead of copied.
+	//Our mapping becomes copy-on-write first, so the file doesn't
+	//change with our later writes to buf.
+	if(n >= BLKSIZE && fd->fd_offset % BLKSIZE == 0 &&
+	   (uintptr_t)buf % PGSIZE == 0 && page_is_private(buf)){
+		if((r=sys_page_map(0,(void*)buf,0,(void*)buf,PTE_P|PTE_U|PTE_COW)) < 0){
+			return r;
+		}
+		return fsipc_page(FSREQ_WRITE_PAGE_REQ(fd->fd_file.id),(void*)buf,
+				  PTE_P|PTE_U|PTE_COW,NULL);
+	}
+
 	int max_len=PGSIZE - (sizeof(int) + sizeof(size_t));
 	
 	if(n>max_len){
@@ -194,3 +251,168 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Get the file server's block cache counters
+int
+fs_cache_stat(struct Fsret_cache_stat *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_CACHE_STAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.cacheStatRet;
+	return 0;
+}
+
+// Map the page of file 'fdnum' at the page-aligned 'offset' read-only
+// at 'dstva', from the file server's cache of program text, which
+// shares one copy of the page among everyone who maps it.  The page
+// doesn't follow later writes to the file.
+int
+file_map_text(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.map_text.req_fileid = fd->fd_file.id;
+	fsipcbuf.map_text.req_offset = offset;
+	return fsipc(FSREQ_MAP_TEXT, dstva);
+}
+
+// Map the block of file 'fdnum' at the block-aligned 'offset' at
+// 'dstva', copy-on-write.  The page is the file server's cached copy of
+// the block, so nothing is copied until one side writes to it.
+// Returns BLKSIZE, or 0 with nothing mapped if the block isn't a whole
+// block of the file, as at its end, or < 0 on error.
+int
+file_read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	return devfile_read_map(fd, offset, dstva);
+}
+
+// Map the block of 'fd' at the block-aligned 'offset' shared at
+// 'dstva', writable if 'write' is set; see mmap.
+static int
+devfile_mmap(struct Fd *fd, off_t offset, bool write, void *dstva)
+{
+	fsipcbuf.mmap.req_fileid = fd->fd_file.id;
+	fsipcbuf.mmap.req_offset = offset;
+	fsipcbuf.mmap.req_write = write;
+	return fsipc(FSREQ_MMAP, dstva);
+}
+
+// Map the page of 'fd' at the page-aligned 'offset' at 'dstva' for a
+// MAP_PRIVATE mapping.  A whole block is mapped copy-on-write from the
+// file server's cache; the file's last, partial block is read into a
+// page of its own.  Returns > 0, 0 past the end of the file, or < 0.
+static int
+mmap_private(struct Fd *fd, off_t offset, void *dstva)
+{
+	off_t pos;
+	int r;
+
+	if ((r = devfile_read_map(fd, offset, dstva)) != 0)
+		return r;
+
+	if ((r = sys_page_alloc(0, dstva, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	pos = fd->fd_offset;
+	fd->fd_offset = offset;
+	r = devfile_read(fd, dstva, PGSIZE);
+	fd->fd_offset = pos;
+	return r;
+}
+
+// Find 'len' bytes of unmapped address space for mmap, a multiple of
+// PGSIZE.  Returns its start, or 0 if there's no room.
+static uintptr_t
+mmap_find(size_t len)
+{
+	uintptr_t va, start;
+
+	start = va = MMAPBASE;
+	while (va < MMAPTOP && va - start < len) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			continue;
+		}
+		if (uvpt[PGNUM(va)] & PTE_P)
+			start = va + PGSIZE;
+		va += PGSIZE;
+	}
+	return va - start >= len && start + len <= MMAPTOP ? start : 0;
+}
+
+// Map 'len' bytes of file 'fdnum' from the page-aligned 'offset' into
+// our address space, with protection 'prot', which must include
+// PROT_READ.  The pages are the file server's cached blocks of the
+// file, so nothing is copied.  With MAP_SHARED, they stay shared with
+// the file server and anyone else mapping them, so everyone sees each
+// other's writes, and a PROT_WRITE mapping's writes reach the disk
+// with the file server's next sync.  The pages are PTE_SHARE, so fork
+// and spawn share them too.  With MAP_PRIVATE, they are copy-on-write
+// and writes to them are our own.  The mapping can't go past the end
+// of the file's last page; the part of it past the end of the file
+// reads as zeros.
+// Returns the address of the mapping, or MAP_FAILED.
+void *
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags)
+{
+	struct Fd *fd;
+	uintptr_t va;
+	void *pg;
+	size_t i;
+	int r;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id ||
+	    offset < 0 || offset % PGSIZE != 0 || len == 0 ||
+	    !(prot & PROT_READ) || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+		return MAP_FAILED;
+	if (flags == MAP_SHARED && (prot & PROT_WRITE) &&
+	    (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return MAP_FAILED;
+
+	len = ROUNDUP(len, PGSIZE);
+	if ((va = mmap_find(len)) == 0)
+		return MAP_FAILED;
+
+	for (i = 0; i < len; i += PGSIZE) {
+		pg = (void *) (va + i);
+		if (flags == MAP_SHARED)
+			r = devfile_mmap(fd, offset + i, prot & PROT_WRITE, pg);
+		else
+			r = mmap_private(fd, offset + i, pg);
+		// Past the end of the file
+		if (r == 0)
+			r = -E_INVAL;
+		// Writes to a read-only page mustn't just copy it
+		if (r > 0 && flags == MAP_PRIVATE && !(prot & PROT_WRITE))
+			r = sys_page_map(0, pg, 0, pg, PTE_P|PTE_U);
+		if (r < 0) {
+			sys_page_unmap_range(0, (void *) va, i + PGSIZE);
+			return MAP_FAILED;
+		}
+	}
+	return (void *) va;
+}
+
+// Remove the mappings of [addr, addr+len), as made by mmap.
+int
+munmap(void *addr, size_t len)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) addr, PGSIZE);
+
+	return sys_page_unmap_range(0, (void *) va,
+				    ROUNDUP((uintptr_t) addr + len, PGSIZE) - va);
+}
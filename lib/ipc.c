@@ -23,7 +23,14 @@ int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
 	// LAB 4: Your code here.
-	int r=sys_ipc_recv(pg == NULL? (void*)0xFFFFFFFF : pg);
+	return ipc_recv_timeout(from_env_store,pg,perm_store,~0U);
+}
+
+// Finish a receive that returned r: fill in the stores as ipc_recv
+// describes and return the value received, or r on error.
+static int32_t
+ipc_result(int r, envid_t *from_env_store, int *perm_store)
+{
 	if(r<0){
 		if(from_env_store!=NULL){
 			*from_env_store=0;
@@ -47,31 +54,71 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return thisenv->env_ipc_value;
 }
 
+// Like ipc_recv, but give up with -E_TIMEOUT once sys_time_msec()
+// reaches 'deadline'.  A deadline of ~0 means wait forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 unsigned int deadline)
+{
+	int r=sys_ipc_recv_timeout(pg == NULL? (void*)0xFFFFFFFF : pg,deadline);
+	return ipc_result(r,from_env_store,perm_store);
+}
+
+// Send a request to the server 'to_env' as ipc_send does and wait for
+// its reply, which is returned as ipc_recv would, with a page mapped
+// at 'rcv_pg' if that is nonnull.  The kernel switches straight to the
+// server, or queues the request if the server is busy, and only the
+// server can send the reply.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r=sys_ipc_call(to_env,val,pg == NULL? (void*)0xFFFFFFFF : pg,perm,
+			   rcv_pg == NULL? (void*)0xFFFFFFFF : rcv_pg);
+	if(r < 0){
+		panic("Failed to call %e\n",r);
+	}
+
+	return ipc_result(r,NULL,perm_store);
+}
+
+// Reply to a client of ipc_call and wait for the next request, which
+// is returned as ipc_recv would.  The kernel switches straight back to
+// the client.  A reply that the client isn't waiting for is sent with
+// ipc_send, and one to a client that has gone away is dropped.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r=sys_ipc_reply_wait(to_env,val,pg == NULL? (void*)0xFFFFFFFF : pg,perm,
+				 rcv_pg == NULL? (void*)0xFFFFFFFF : rcv_pg);
+	if(r == 0){
+		return ipc_result(r,from_env_store,perm_store);
+	}
+
+	if(r == -E_IPC_NOT_RECV){
+		ipc_send(to_env,val,pg,perm);
+	}else if(r != -E_BAD_ENV){
+		panic("Failed to reply %e\n",r);
+	}
+	return ipc_recv(from_env_store,rcv_pg,perm_store);
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// If 'toenv' isn't receiving, the kernel blocks us in a queue until it
+// is, so this function returns once the message is taken.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
-	int r;
-	while(true){
-		r=sys_ipc_try_send(to_env,val,pg == NULL? (void*)0xFFFFFFFF : pg,perm);
-		if(r == 0){
-			return;
-		}
-
-		if(r < 0 && r != -E_IPC_NOT_RECV){
-			panic("Failed to send %e\n",r);
-		}
-
-		//Yield
-		sys_yield();
+	int r=sys_ipc_send(to_env,val,pg == NULL? (void*)0xFFFFFFFF : pg,perm);
+	if(r < 0){
+		panic("Failed to send %e\n",r);
 	}
 }
 
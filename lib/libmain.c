@@ -2,6 +2,7 @@
 // entry.S already took care of defining envs, pages, uvpd, and uvpt.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 extern void umain(int argc, char **argv);
 
@@ -11,6 +12,12 @@ const char *binaryname = "<unknown>";
 void
 libmain(int argc, char **argv)
 {
+	uint32_t edx;
+
+	// use the fast syscall path if the CPU has it
+	cpuid(1, NULL, NULL, NULL, &edx);
+	sysenter_enabled = (edx & CPUID_SEP) != 0;
+
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
 	envid_t env_id=sys_getenvid();
@@ -5,11 +5,23 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Most bytes of a segment map_segment reads through UTEMP at once.
+#define SEGCHUNK		(64 * PGSIZE)
+// Most page operations copy_shared_pages hands the kernel at once.
+#define SHAREBATCH		32
+// Where a lazily spawned child keeps the Fd page of its program, just
+// below the fd table in fd.c.  close_all doesn't reach it, so the file
+// stays open for the file server to page from until the child exits.
+#define PAGERFD			((void*) (0xD0000000 - PGSIZE))
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
+static int map_segment_lazy(envid_t child, uintptr_t va, size_t memsz,
+			    int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static envid_t spawn_common(const char *prog, const char **argv, bool lazy);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -18,6 +30,24 @@ static int copy_shared_pages(envid_t child);
 // Returns child envid on success, < 0 on failure.
 int
 spawn(const char *prog, const char **argv)
+{
+	return spawn_common(prog, argv, false);
+}
+
+// Spawn a child whose program is paged in on demand: its segments are
+// registered with the kernel as regions backed by the file, and each
+// page is read from the file server when the child first touches it,
+// so the child starts in the same time whatever the program's size.
+// Syscalls that take a page or a buffer from the child see pages it
+// hasn't touched yet as unmapped.
+int
+spawn_lazy(const char *prog, const char **argv)
+{
+	return spawn_common(prog, argv, true);
+}
+
+static envid_t
+spawn_common(const char *prog, const char **argv, bool lazy)
 {
 	unsigned char elf_buf[512];
 	struct Trapframe child_tf;
@@ -26,6 +56,7 @@ spawn(const char *prog, const char **argv)
 	int fd, i, r;
 	struct Elf *elf;
 	struct Proghdr *ph;
+	struct Fd *fdp;
 	int perm;
 
 	// This code follows this procedure:
@@ -118,10 +149,13 @@ spawn(const char *prog, const char **argv)
 		perm = PTE_P | PTE_U;
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
-		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+		if ((r = (lazy ? map_segment_lazy : map_segment)(child, ph->p_va,
+				ph->p_memsz, fd, ph->p_filesz, ph->p_offset, perm)) < 0)
 			goto error;
 	}
+	if (lazy && ((r = fd_lookup(fd, &fdp)) < 0 ||
+		     (r = sys_page_map(0, fdp, child, PAGERFD, PTE_P|PTE_U)) < 0))
+		goto error;
 	close(fd);
 	fd = -1;
 
@@ -264,8 +298,8 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, j, n, r, cperm;
+	size_t shared, end;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,25 +310,94 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
+	// Read-only pages are shared with every other spawn of the same
+	// program, through the file server's text cache.  Its pages hold
+	// whole blocks of the file, so a last partial page only fits when
+	// no zeroed part of the segment follows.
+	shared = 0;
+	if (!(perm & PTE_W) && PGOFF(fileoffset) == 0)
+		shared = filesz == memsz ? ROUNDUP(filesz, PGSIZE) : ROUNDDOWN(filesz, PGSIZE);
+	for (i = 0; i < shared; i += n) {
+		n = MIN(shared - i, SEGCHUNK);
+		for (j = 0; j < n; j += PGSIZE)
+			if ((r = file_map_text(fd, fileoffset + i + j, UTEMP + j)) < 0) {
+				sys_page_unmap_range(0, UTEMP, n);
 				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			}
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, perm)) < 0)
+			panic("spawn: sys_page_map_range text: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
+	}
+
+	// The other file-backed pages go through UTEMP a chunk at a time.
+	// Whole blocks are the file server's cached pages, mapped
+	// copy-on-write; the rest are read into pages of their own.  The
+	// child gets writable pages copy-on-write too, as we map them.
+	cperm = perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm;
+	end = MIN(ROUNDUP(filesz, PGSIZE), ROUNDUP(memsz, PGSIZE));
+	for (; i < end; i += n) {
+		n = MIN(end - i, SEGCHUNK);
+		for (j = 0; j < n; j += PGSIZE) {
+			if (PGOFF(fileoffset) == 0 && i + j + PGSIZE <= filesz &&
+			    (r = file_read_map(fd, fileoffset + i + j, UTEMP + j)) != 0) {
+				if (r < 0)
+					goto fail;
+				continue;
+			}
+			if ((r = sys_page_alloc(0, UTEMP + j, PTE_P|PTE_U|PTE_W)) < 0 ||
+			    (r = seek(fd, fileoffset + i + j)) < 0 ||
+			    (r = readn(fd, UTEMP + j, MIN(PGSIZE, filesz - i - j))) < 0)
+				goto fail;
 		}
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, cperm)) < 0)
+			panic("spawn: sys_page_map_range data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
 	}
+
+	// The rest are blank
+	if (i < memsz &&
+	    (r = sys_page_alloc_range(child, (void*) (va + i), ROUNDUP(memsz, PGSIZE) - i, perm)) < 0)
+		return r;
 	return 0;
+
+fail:
+	sys_page_unmap_range(0, UTEMP, n);
+	return r;
+}
+
+// Like map_segment, but just registers the segment as a region of the
+// child for the file server to page in from fd.
+static int
+map_segment_lazy(envid_t child, uintptr_t va, size_t memsz,
+	int fd, size_t filesz, off_t fileoffset, int perm)
+{
+	static envid_t fsenv;
+	struct EnvRegion rg;
+	struct Fd *fdp;
+	int i, r;
+
+	if ((r = fd_lookup(fd, &fdp)) < 0)
+		return r;
+	if (fdp->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if ((i = PGOFF(va))) {
+		va -= i;
+		memsz += i;
+		filesz += i;
+		fileoffset -= i;
+	}
+
+	rg.er_va = va;
+	rg.er_memsz = memsz;
+	rg.er_filesz = filesz;
+	rg.er_offset = fileoffset;
+	rg.er_fileid = fdp->fd_file.id;
+	rg.er_pager = fsenv;
+	rg.er_perm = perm;
+	return sys_env_add_region(child, &rg);
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -302,24 +405,38 @@ static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
-	int r;
-
-	for(uint32_t i=0;i<NPTENTRIES*NPDENTRIES;i++){
-		uintptr_t va=i*PGSIZE;
-		if(!(PDE_USER(va) & PTE_P) || !(PTE_USER(va) & PTE_P)){
+	// Runs of contiguous shared pages with the same permissions become
+	// one operation, and the operations go to the kernel in batches.
+	struct PageOp ops[SHAREBATCH];
+	int n=0,r;
+
+	for(uintptr_t va=0;va<UTOP;va+=PGSIZE){
+		//4MB pages can't be shared with sys_page_map
+		if(!(PDE_USER(va) & PTE_P) || (PDE_USER(va) & PTE_PS)){
+			va=ROUNDUP(va+1,PTSIZE)-PGSIZE;
 			continue;
 		}
 
 		pte_t pte=PTE_USER(va);
-		if(pte & PTE_SHARE){
-			//Map shared pages
-			if((r=sys_page_map(thisenv->env_id,(void*)va,
-			child,(void*)va,pte&0xFFF&PTE_SYSCALL)) < 0){
-				// panic("Failed to map shared page at %x: %e\n",va,r);
+		if(!(pte & PTE_P) || !(pte & PTE_SHARE)){
+			continue;
+		}
+
+		int perm=pte&PTE_SYSCALL;
+		if(n>0 && ops[n-1].srcva+ops[n-1].len == va && ops[n-1].perm == perm){
+			ops[n-1].len+=PGSIZE;
+			continue;
+		}
+
+		if(n == SHAREBATCH){
+			if((r=sys_page_batch(ops,n)) < 0)
 				return r;
-			}
+			n=0;
 		}
+		ops[n++]=(struct PageOp){.op=PAGEOP_MAP,.srcenv=0,.srcva=va,
+			.dstenv=child,.dstva=va,.len=PGSIZE,.perm=perm};
 	}
+	if(n>0 && (r=sys_page_batch(ops,n)) < 0)
+		return r;
 	return 0;
 }
-
@@ -3,6 +3,38 @@
 #include <inc/syscall.h>
 #include <inc/lib.h>
 
+// Enter the kernel with sysenter rather than int $T_SYSCALL.
+// libmain() turns it on when the CPU supports it.
+bool sysenter_enabled;
+
+// Fast system call: the same registers as below, but enter the kernel
+// with sysenter.  sysenter saves nothing, so pass our %esp in %ebp and
+// push the return address for the kernel to find.  sysexit comes back
+// there with %esp restored from %ecx and %eip from %edx.
+static inline int32_t
+fast_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	int32_t ret;
+
+	asm volatile("pushl %%ebp\n\t"
+		     "pushl $1f\n\t"
+		     "movl %%esp, %%ebp\n\t"
+		     "sysenter\n"
+		     "1:\n\t"
+		     "addl $4, %%esp\n\t"
+		     "popl %%ebp\n"
+		     : "=a" (ret),
+		       "+d" (a1),
+		       "+c" (a2)
+		     : "0" (num),
+		       "b" (a3),
+		       "D" (a4),
+		       "S" (a5)
+		     : "cc", "memory");
+
+	return ret;
+}
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
@@ -10,7 +42,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
-	// Interrupt kernel with T_SYSCALL.
+	// Interrupt kernel with T_SYSCALL, or use sysenter if we can.
 	//
 	// The "volatile" tells the assembler not to optimize
 	// this instruction away just because we don't use the
@@ -20,16 +52,19 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
-	asm volatile("int %1\n"
-		     : "=a" (ret)
-		     : "i" (T_SYSCALL),
-		       "a" (num),
-		       "d" (a1),
-		       "c" (a2),
-		       "b" (a3),
-		       "D" (a4),
-		       "S" (a5)
-		     : "cc", "memory");
+	if (sysenter_enabled)
+		ret = fast_syscall(num, a1, a2, a3, a4, a5);
+	else
+		asm volatile("int %1\n"
+			     : "=a" (ret)
+			     : "i" (T_SYSCALL),
+			       "a" (num),
+			       "d" (a1),
+			       "c" (a2),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -85,8 +120,53 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, size_t len, int perm)
+{
+	// perm rides in the low bits of the page-aligned dstva
+	if (PGOFF(dstva) || (perm & ~0xFFF))
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva | perm, len);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
+int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+	return syscall(SYS_page_batch, 1, (uint32_t) ops, n, 0, 0, 0);
+}
+
+int
+sys_env_add_region(envid_t envid, const struct EnvRegion *rg)
+{
+	return syscall(SYS_env_add_region, 1, envid, (uint32_t) rg, 0, 0, 0);
+}
+
+int
+sys_pagein(envid_t envid, void *srcva)
+{
+	return syscall(SYS_pagein, 0, envid, (uint32_t) srcva, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -117,12 +197,78 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_timeout(void *dstva, unsigned int deadline)
+{
+	return syscall(SYS_ipc_recv_timeout, 0, (uint32_t)dstva, deadline, 0, 0, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(unsigned int irq, unsigned int deadline)
+{
+	return syscall(SYS_irq_wait, 0, irq, deadline, 0, 0, 0);
+}
+
+int
+sys_page_physaddr(void *va)
+{
+	return syscall(SYS_page_physaddr, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ide_dma_base(void)
+{
+	return syscall(SYS_ide_dma_base, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_blk_probe(void)
+{
+	return syscall(SYS_blk_probe, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_blk_submit(uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	return syscall(SYS_blk_submit, 0, secno, (uint32_t) va, nsecs, write, 0);
+}
+
+int
+sys_blk_poll(int tag)
+{
+	return syscall(SYS_blk_poll, 0, tag, 0, 0, 0, 0);
+}
+
 
 int
 sys_transmit_packet(void* addr,int len){
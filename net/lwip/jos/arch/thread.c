@@ -38,6 +38,7 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 
     cur_tc->tc_wait_addr = addr;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_wait_until = msec;
 
     while (p < msec) {
 	if (p < s)
@@ -47,12 +48,34 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// With no other thread to run nothing can wake us before the
+	// timeout, so block in the kernel instead of spinning.
+	if (!thread_queue.tq_first)
+	    sys_sleep_until(msec);
+	else
+	    thread_yield();
 	p = sys_time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_wait_until = 0;
+}
+
+// The earliest timeout of any thread blocked in thread_wait(), or ~0.
+// A thread that blocks the whole env (e.g. in ipc_recv) can sleep in
+// the kernel until then.
+uint32_t
+thread_next_timeout(void)
+{
+    struct thread_context *tc = thread_queue.tq_first;
+    uint32_t to = ~0;
+    while (tc) {
+	if (tc->tc_wait_until && tc->tc_wait_until < to)
+	    to = tc->tc_wait_until;
+	tc = tc->tc_queue_link;
+    }
+    return to;
 }
 
 int
@@ -25,6 +25,7 @@ struct thread_context {
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
     volatile char	tc_wakeup;
+    uint32_t		tc_wait_until;	// thread_wait() timeout, 0 if not waiting
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
     struct thread_context *tc_queue_link;
@@ -270,7 +270,15 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		// Wake up in time for the next lwIP timeout even if no
+		// request comes in.
+		reqno = ipc_recv_timeout((int32_t *) &whom, (void *) va, &perm,
+					 thread_next_timeout());
+		if (reqno == -E_TIMEOUT) {
+			put_buffer(va);
+			thread_yield();
+			continue;
+		}
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
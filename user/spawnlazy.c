@@ -0,0 +1,78 @@
+// Spawn this program again with spawn_lazy, and have the child check
+// that pages of its text, data and bss aren't there until it touches
+// them, and hold the right contents once they are.
+
+#include <inc/lib.h>
+
+#define NPAGES	4
+#define NWORDS	(NPAGES * PGSIZE / sizeof(uint32_t))
+#define WORD(p)	((p) * PGSIZE / sizeof(uint32_t))
+
+// Data from the file, a different word at the start of each page
+uint32_t lazydata[NWORDS] __attribute__((aligned(PGSIZE))) = {
+	[WORD(0)] = 0x1000, [WORD(1)] = 0x1001,
+	[WORD(2)] = 0x1002, [WORD(3)] = 0x1003,
+};
+uint32_t lazybss[NWORDS] __attribute__((aligned(PGSIZE)));
+
+// Text on a page of its own, which nothing runs before the check.
+// lazytext_end, on the next page, keeps the code after it off its page.
+static int __attribute__((noinline, aligned(PGSIZE), section(".text.lazy")))
+lazytext(int x)
+{
+	return 3 * x + 1;
+}
+
+static void __attribute__((noinline, aligned(PGSIZE), section(".text.lazy"), used))
+lazytext_end(void)
+{
+}
+
+static bool
+is_mapped(const void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static void
+child(void)
+{
+	int p;
+
+	if (is_mapped(lazytext))
+		panic("text page mapped before it was run");
+	if (lazytext(14) != 43)
+		panic("lazy text returned the wrong value");
+
+	for (p = NPAGES - 1; p >= 0; p--) {
+		if (is_mapped(&lazydata[WORD(p)]) || is_mapped(&lazybss[WORD(p)]))
+			panic("data or bss page %d mapped before it was touched", p);
+		if (lazydata[WORD(p)] != 0x1000 + p || lazydata[WORD(p) + 1] != 0)
+			panic("data page %d holds %08x", p, lazydata[WORD(p)]);
+		if (lazybss[WORD(p)] != 0)
+			panic("bss page %d isn't zero", p);
+		lazydata[WORD(p)] = lazybss[WORD(p)] = 0x2000 + p;
+	}
+	for (p = 0; p < NPAGES; p++)
+		if (lazydata[WORD(p)] != 0x2000 + p || lazybss[WORD(p)] != 0x2000 + p)
+			panic("page %d didn't hold its value", p);
+
+	cprintf("lazy child is good\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *args[] = { "spawnlazy", "child", 0 };
+	envid_t r;
+
+	if (argc > 1 && strcmp(argv[1], "child") == 0) {
+		child();
+		return;
+	}
+
+	if ((r = spawn_lazy("spawnlazy", args)) < 0)
+		panic("spawn_lazy(spawnlazy) failed: %e", r);
+	wait(r);
+	cprintf("spawnlazy done\n");
+}
@@ -0,0 +1,36 @@
+// Compare the round-trip latency of a null system call made with
+// int $T_SYSCALL and with sysenter/sysexit.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+// Average TSC cycles per sys_getenvid() call.
+static uint32_t
+bench(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	return (read_tsc() - start) / NCALLS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	bool fast = sysenter_enabled;
+
+	sysenter_enabled = false;
+	cprintf("int $T_SYSCALL: %u cycles per syscall\n", bench());
+
+	if (!fast) {
+		cprintf("sysenter: not supported by this CPU\n");
+		return;
+	}
+	sysenter_enabled = true;
+	cprintf("sysenter: %u cycles per syscall\n", bench());
+}
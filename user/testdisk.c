@@ -0,0 +1,75 @@
+// Write a file that takes the disk several commands to write back, and
+// read it back, both now and after a reboot.  The first run writes
+// /testdisk.dat, syncs it and checks it; run again on the same disk
+// image, which the block cache then knows nothing of, it checks the
+// file as read from the disk and empties it for the next run.  For the
+// virtio disk:
+//
+//	make VIRTIO=1 run-testdisk-nox		(twice)
+
+#include <inc/lib.h>
+
+#define FILENAME	"/testdisk.dat"
+#define NBLOCKS		128
+#define NWORDS		(BLKSIZE / sizeof(uint32_t))
+
+static uint32_t buf[NWORDS];
+
+// A different word everywhere in the file
+static uint32_t
+pattern(uint32_t blk, uint32_t w)
+{
+	return (blk * NWORDS + w) * 2654435761U;
+}
+
+static void
+check(int fd, const char *when)
+{
+	uint32_t blk, w;
+	int r;
+
+	if ((r = seek(fd, 0)) < 0)
+		panic("seek: %e", r);
+	for (blk = 0; blk < NBLOCKS; blk++) {
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read block %d %s: %e", blk, when, r < 0 ? r : -E_EOF);
+		for (w = 0; w < NWORDS; w++)
+			if (buf[w] != pattern(blk, w))
+				panic("block %d word %d is %08x %s", blk, w, buf[w], when);
+	}
+	cprintf("%s is good %s\n", FILENAME, when);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	uint32_t blk, w;
+	int fd, r;
+
+	if ((fd = open(FILENAME, O_RDWR | O_CREAT)) < 0)
+		panic("open %s: %e", FILENAME, fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+
+	if (st.st_size != 0) {
+		check(fd, "after a reboot");
+		if ((r = ftruncate(fd, 0)) < 0 || (r = sync()) < 0)
+			panic("emptying %s: %e", FILENAME, r);
+		close(fd);
+		cprintf("testdisk done\n");
+		return;
+	}
+
+	for (blk = 0; blk < NBLOCKS; blk++) {
+		for (w = 0; w < NWORDS; w++)
+			buf[w] = pattern(blk, w);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write block %d: %e", blk, r < 0 ? r : -E_NO_DISK);
+	}
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	check(fd, "before a reboot");
+	close(fd);
+	cprintf("boot again to read it back from the disk\n");
+}
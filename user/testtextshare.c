@@ -0,0 +1,40 @@
+// Check that two spawns of the same program share the pages of its
+// text, which come from the file server's text cache.
+
+#include <inc/lib.h>
+
+// The first page of text, read-only and whole in the file
+#define TEXTVA	((void *) UTEXT)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child[2];
+	int i, r;
+
+	if (argc > 1) {
+		// A child just waits to be told to go
+		ipc_recv(NULL, NULL, NULL);
+		return;
+	}
+
+	for (i = 0; i < 2; i++)
+		if ((child[i] = spawnl("/testtextshare", "testtextshare", "child", 0)) < 0)
+			panic("spawn: %e", child[i]);
+
+	// The children can't run ahead and exit before they're looked at
+	for (i = 0; i < 2; i++)
+		if ((r = sys_page_map(child[i], TEXTVA, 0, UTEMP + i * PGSIZE, PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	if (PTE_ADDR(uvpt[PGNUM(UTEMP)]) != PTE_ADDR(uvpt[PGNUM(UTEMP + PGSIZE)]))
+		panic("spawns have text pages at %08x and %08x",
+		      PTE_ADDR(uvpt[PGNUM(UTEMP)]), PTE_ADDR(uvpt[PGNUM(UTEMP + PGSIZE)]));
+	cprintf("spawns share text pages right\n");
+	sys_page_unmap(0, UTEMP);
+	sys_page_unmap(0, UTEMP + PGSIZE);
+
+	for (i = 0; i < 2; i++) {
+		ipc_send(child[i], 0, NULL, 0);
+		wait(child[i]);
+	}
+}